@@ -0,0 +1,521 @@
+/*
+ * bench.c
+ *
+ * Malloc benchmark: runs standard allocation workloads and reports throughput, latency, peak RSS and fragmentation for
+ * each of them. Built against malloc.c as `bench`, and against the C library's malloc as `bench_libc` for a baseline.
+ *
+ * Usage: bench [scenario...]. Every scenario runs in its own process so that peak RSS is measured separately.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef BENCH_LIBC
+#include <malloc.h>
+#else
+#include "malloc.h"
+#include "memleak.h"
+#endif
+
+#define THREAD_COUNT 4
+#define SLOT_COUNT 4096
+#define CHURN_OPERATIONS 2000000
+#define QUEUE_SIZE 1024
+#define QUEUE_ITEMS 1000000
+#define VECTOR_GROWTHS 200
+#define VECTOR_MAX_SIZE (4 * 1024 * 1024)
+#define MIXED_OPERATIONS 500000
+#define LARSON_ROUNDS 8
+#define LARSON_OPERATIONS 100000
+#define ADVERSARIAL_ROUNDS 16
+#define RANDOM_ACCESS_NODES 65536
+#define RANDOM_ACCESS_HOPS 2000000
+// Enough for every node of the random-access scenarios, with room to spare.
+#define RANDOM_ACCESS_RESERVE_MB 256
+// Enough latency samples for the busiest scenario on one thread.
+#define MAX_SAMPLES (2 * CHURN_OPERATIONS + SLOT_COUNT)
+
+/**
+ * The latency of every allocator call made by one thread, in nanoseconds.
+ */
+struct recorder {
+    uint32_t* samples;
+    size_t count;
+    uint64_t seed;
+};
+
+/**
+ * The results of a scenario.
+ */
+struct run {
+    struct recorder recorders[THREAD_COUNT];
+    double seconds;
+    size_t internal;
+    size_t external;
+};
+
+/**
+ * A live allocation and the size that was asked for it.
+ */
+struct slot {
+    void* ptr;
+    size_t size;
+};
+
+/**
+ * A bounded single-producer single-consumer queue of allocations.
+ */
+struct queue {
+    void* items[QUEUE_SIZE];
+    size_t head;
+    size_t tail;
+};
+
+/**
+ * The work handed to one thread of a multi-threaded scenario.
+ */
+struct worker {
+    struct recorder* recorder;
+    struct queue* queue;
+    struct slot* slots;
+    // The largest object the producer of a queue allocates.
+    size_t max_size;
+};
+
+struct scenario {
+    char* name;
+    void (*run)(struct run* run);
+};
+
+/**
+ * Reads a monotonic clock.
+ *
+ * @return The current time in nanoseconds.
+ */
+uint64_t now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+/**
+ * Advances a xorshift generator, so that every run of a scenario makes the same requests.
+ *
+ * @param recorder The recorder holding the generator's state.
+ * @return The next pseudo-random number.
+ */
+uint64_t next_random(struct recorder* recorder) {
+    recorder->seed ^= recorder->seed << 13;
+    recorder->seed ^= recorder->seed >> 7;
+    recorder->seed ^= recorder->seed << 17;
+    return recorder->seed;
+}
+
+/**
+ * Picks a size between `min` and `max` bytes, with every power of two equally likely, like real programs.
+ *
+ * @param recorder The recorder holding the generator's state.
+ * @param min The smallest size.
+ * @param max The biggest size.
+ * @return The size.
+ */
+size_t random_size(struct recorder* recorder, size_t min, size_t max) {
+    int min_log = 63 - __builtin_clzl(min);
+    int max_log = 63 - __builtin_clzl(max);
+    int log = min_log + (int) (next_random(recorder) % (max_log - min_log + 1));
+    size_t size = ((size_t) 1 << log) + next_random(recorder) % ((size_t) 1 << log);
+    return size < min ? min : size > max ? max : size;
+}
+
+/**
+ * Records how long an allocator call took.
+ *
+ * @param recorder The calling thread's recorder.
+ * @param start The time the call started at.
+ */
+void record(struct recorder* recorder, uint64_t start) {
+    uint64_t elapsed = now() - start;
+    if (recorder->count < MAX_SAMPLES) {
+        recorder->samples[recorder->count++] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t) elapsed;
+    }
+}
+
+void* timed_malloc(struct recorder* recorder, size_t size) {
+    uint64_t start = now();
+    void* ptr = malloc(size);
+    record(recorder, start);
+    // Touch the memory like a real program would, which also catches allocators handing out bad pointers.
+    memset(ptr, 0xA5, size < 64 ? size : 64);
+    return ptr;
+}
+
+void* timed_realloc(struct recorder* recorder, void* ptr, size_t size) {
+    uint64_t start = now();
+    ptr = realloc(ptr, size);
+    record(recorder, start);
+    return ptr;
+}
+
+void timed_free(struct recorder* recorder, void* ptr) {
+    uint64_t start = now();
+    free(ptr);
+    record(recorder, start);
+}
+
+/**
+ * Measures the fragmentation of the heap while `slots` are live. The internal fragmentation is the space wasted inside
+ * allocated blocks, and the external fragmentation is the space in free blocks.
+ *
+ * @param run The run to record the fragmentation to.
+ * @param slots The live allocations.
+ * @param count The number of slots.
+ */
+void measure_fragmentation(struct run* run, struct slot* slots, size_t count) {
+#ifdef BENCH_LIBC
+    run->internal = 0;
+    for (size_t i = 0; i < count; i++) {
+        run->internal += slots[i].ptr ? malloc_usable_size(slots[i].ptr) - slots[i].size : 0;
+    }
+    struct mallinfo2 info = mallinfo2();
+    run->external = info.fordblks + info.fsmblks;
+#else
+    (void) slots;
+    (void) count;
+    get_total_memory_leak(&run->internal, &run->external);
+#endif
+}
+
+/**
+ * Small-object churn: keeps SLOT_COUNT objects of 8 to 128 bytes live, replacing a random one on every step.
+ */
+void run_churn(struct run* run) {
+    struct recorder* recorder = &run->recorders[0];
+    struct slot* slots = calloc(SLOT_COUNT, sizeof(struct slot));
+    for (int i = 0; i < CHURN_OPERATIONS; i++) {
+        struct slot* slot = &slots[next_random(recorder) % SLOT_COUNT];
+        if (slot->ptr) {
+            timed_free(recorder, slot->ptr);
+        }
+        slot->size = 8 + next_random(recorder) % 121;
+        slot->ptr = timed_malloc(recorder, slot->size);
+    }
+    measure_fragmentation(run, slots, SLOT_COUNT);
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        free(slots[i].ptr);
+    }
+    free(slots);
+}
+
+/**
+ * Allocates QUEUE_ITEMS objects and passes them to the consumer, which frees them on another thread.
+ */
+void* produce(void* argument) {
+    struct worker* worker = argument;
+    struct queue* queue = worker->queue;
+    for (int i = 0; i < QUEUE_ITEMS; i++) {
+        void* item = timed_malloc(worker->recorder, random_size(worker->recorder, 16, worker->max_size));
+        while (queue->head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == QUEUE_SIZE) {
+            sched_yield();
+        }
+        queue->items[queue->head % QUEUE_SIZE] = item;
+        __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/**
+ * Frees the QUEUE_ITEMS objects allocated by the producer.
+ */
+void* consume(void* argument) {
+    struct worker* worker = argument;
+    struct queue* queue = worker->queue;
+    for (int i = 0; i < QUEUE_ITEMS; i++) {
+        while (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == queue->tail) {
+            sched_yield();
+        }
+        timed_free(worker->recorder, queue->items[queue->tail % QUEUE_SIZE]);
+        __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/**
+ * Runs a producer thread allocating objects of up to `max_size` bytes and a consumer thread freeing them.
+ *
+ * @param run The run to record to.
+ * @param max_size The largest object allocated.
+ */
+void run_queue(struct run* run, size_t max_size) {
+    struct queue* queue = calloc(1, sizeof(struct queue));
+    struct worker producer = {&run->recorders[0], queue, NULL, max_size};
+    struct worker consumer = {&run->recorders[1], queue, NULL, max_size};
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, produce, &producer);
+    pthread_create(&threads[1], NULL, consume, &consumer);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    measure_fragmentation(run, NULL, 0);
+    free(queue);
+}
+
+/**
+ * Producer/consumer: one thread allocates and another frees, so every object crosses threads.
+ */
+void run_producer_consumer(struct run* run) {
+    run_queue(run, 512);
+}
+
+/**
+ * Producer/consumer with small objects only, which all come from slabs owned by the producer.
+ */
+void run_producer_consumer_small(struct run* run) {
+    run_queue(run, 256);
+}
+
+/**
+ * Realloc growth: grows a vector-like buffer by half its size at a time up to VECTOR_MAX_SIZE, VECTOR_GROWTHS times,
+ * with a small allocation in between growths like a program building other objects.
+ */
+void run_vector_growth(struct run* run) {
+    struct recorder* recorder = &run->recorders[0];
+    struct slot others[64] = {{NULL, 0}};
+    for (int i = 0; i < VECTOR_GROWTHS; i++) {
+        char* buffer = NULL;
+        for (size_t size = 16; size <= VECTOR_MAX_SIZE; size += size / 2) {
+            buffer = timed_realloc(recorder, buffer, size);
+            buffer[size - 1] = (char) size;
+            struct slot* other = &others[next_random(recorder) % 64];
+            if (other->ptr) {
+                timed_free(recorder, other->ptr);
+            }
+            other->size = random_size(recorder, 16, 256);
+            other->ptr = timed_malloc(recorder, other->size);
+        }
+        if (i == VECTOR_GROWTHS - 1) {
+            measure_fragmentation(run, others, 64);
+        }
+        timed_free(recorder, buffer);
+    }
+    for (int i = 0; i < 64; i++) {
+        free(others[i].ptr);
+    }
+}
+
+/**
+ * Mixed-size random allocation: keeps SLOT_COUNT objects of 16 bytes to 64 KiB live, replacing a random one on every
+ * step.
+ */
+void run_mixed(struct run* run) {
+    struct recorder* recorder = &run->recorders[0];
+    struct slot* slots = calloc(SLOT_COUNT, sizeof(struct slot));
+    for (int i = 0; i < MIXED_OPERATIONS; i++) {
+        struct slot* slot = &slots[next_random(recorder) % SLOT_COUNT];
+        if (slot->ptr) {
+            timed_free(recorder, slot->ptr);
+        }
+        slot->size = random_size(recorder, 16, 64 * 1024);
+        slot->ptr = timed_malloc(recorder, slot->size);
+    }
+    measure_fragmentation(run, slots, SLOT_COUNT);
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        free(slots[i].ptr);
+    }
+    free(slots);
+}
+
+/**
+ * Replaces random objects in the worker's slots, most of which were allocated by another thread.
+ */
+void* larson_round(void* argument) {
+    struct worker* worker = argument;
+    for (int i = 0; i < LARSON_OPERATIONS; i++) {
+        struct slot* slot = &worker->slots[next_random(worker->recorder) % (SLOT_COUNT / THREAD_COUNT)];
+        if (slot->ptr) {
+            timed_free(worker->recorder, slot->ptr);
+        }
+        slot->size = random_size(worker->recorder, 16, 1024);
+        slot->ptr = timed_malloc(worker->recorder, slot->size);
+    }
+    return NULL;
+}
+
+/**
+ * Larson: like a server, every round each thread works on a set of objects that the previous round's neighbouring
+ * thread allocated, freeing them from a different thread than the one that allocated them.
+ */
+void run_larson(struct run* run) {
+    struct slot* slots = calloc(SLOT_COUNT, sizeof(struct slot));
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        struct worker workers[THREAD_COUNT];
+        pthread_t threads[THREAD_COUNT];
+        for (int i = 0; i < THREAD_COUNT; i++) {
+            // Hand each thread the slots of its neighbour from the previous round.
+            int owner = (i + round) % THREAD_COUNT;
+            workers[i] = (struct worker) {&run->recorders[i], NULL, &slots[owner * (SLOT_COUNT / THREAD_COUNT)], 0};
+            pthread_create(&threads[i], NULL, larson_round, &workers[i]);
+        }
+        for (int i = 0; i < THREAD_COUNT; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    measure_fragmentation(run, slots, SLOT_COUNT);
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        free(slots[i].ptr);
+    }
+    free(slots);
+}
+
+/**
+ * Fragmentation-adversarial: interleaves short-lived small objects with long-lived ones, frees the short-lived ones
+ * and then asks for slightly bigger objects that can't reuse the holes left behind, round after round.
+ */
+void run_adversarial(struct run* run) {
+    struct recorder* recorder = &run->recorders[0];
+    struct slot* kept = calloc(ADVERSARIAL_ROUNDS * SLOT_COUNT, sizeof(struct slot));
+    void** holes = calloc(SLOT_COUNT, sizeof(void*));
+    size_t kept_count = 0;
+    for (int round = 0; round < ADVERSARIAL_ROUNDS; round++) {
+        size_t hole_size = 64 << (round % 6);
+        for (int i = 0; i < SLOT_COUNT; i++) {
+            holes[i] = timed_malloc(recorder, hole_size);
+            kept[kept_count].size = 16;
+            kept[kept_count++].ptr = timed_malloc(recorder, 16);
+        }
+        for (int i = 0; i < SLOT_COUNT; i++) {
+            timed_free(recorder, holes[i]);
+        }
+    }
+    measure_fragmentation(run, kept, kept_count);
+    for (size_t i = 0; i < kept_count; i++) {
+        free(kept[i].ptr);
+    }
+    free(holes);
+    free(kept);
+}
+
+/**
+ * Random access: links RANDOM_ACCESS_NODES objects of 512 to 2048 bytes, around 80 MiB, into one cycle in random order
+ * and follows it, timing every hop. Once the heap is far bigger than the TLB reaches, most hops miss it.
+ */
+void run_random_access(struct run* run) {
+    struct recorder* recorder = &run->recorders[0];
+    void*** nodes = calloc(RANDOM_ACCESS_NODES, sizeof(void**));
+    for (int i = 0; i < RANDOM_ACCESS_NODES; i++) {
+        nodes[i] = timed_malloc(recorder, random_size(recorder, 512, 2048));
+    }
+    for (int i = RANDOM_ACCESS_NODES - 1; i > 0; i--) {
+        size_t j = next_random(recorder) % (i + 1);
+        void** swapped = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = swapped;
+    }
+    for (int i = 0; i < RANDOM_ACCESS_NODES; i++) {
+        *nodes[i] = nodes[(i + 1) % RANDOM_ACCESS_NODES];
+    }
+    void** node = nodes[0];
+    for (int i = 0; i < RANDOM_ACCESS_HOPS; i++) {
+        uint64_t start = now();
+        node = *node;
+        record(recorder, start);
+    }
+    // Keep the chase from being optimized out.
+    if (!node) {
+        abort();
+    }
+    for (int i = 0; i < RANDOM_ACCESS_NODES; i++) {
+        timed_free(recorder, nodes[i]);
+    }
+    free(nodes);
+}
+
+/**
+ * Random access with the heap grown inside a reserved region backed by huge pages, so that each TLB entry covers 2 MiB
+ * instead of 4 KiB. The C library has no such mode, so there this is the same as random-access.
+ */
+void run_random_access_huge(struct run* run) {
+#ifndef BENCH_LIBC
+    mallopt(M_HEAP_RESERVE, RANDOM_ACCESS_RESERVE_MB);
+    mallopt(M_HUGEPAGE_THRESHOLD, 0);
+#endif
+    run_random_access(run);
+}
+
+struct scenario scenarios[] = {
+        {"churn", run_churn},
+        {"producer-consumer", run_producer_consumer},
+        {"producer-consumer-small", run_producer_consumer_small},
+        {"vector-growth", run_vector_growth},
+        {"mixed", run_mixed},
+        {"larson", run_larson},
+        {"adversarial", run_adversarial},
+        {"random-access", run_random_access},
+        {"random-access-huge", run_random_access_huge},
+};
+
+int compare_samples(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Runs a scenario in the calling process and prints its results.
+ *
+ * @param scenario The scenario to run.
+ */
+void run_scenario(struct scenario* scenario) {
+    struct run run = {0};
+    // Keep the samples out of the allocator being measured.
+    size_t samples_length = THREAD_COUNT * MAX_SAMPLES * sizeof(uint32_t);
+    uint32_t* samples = mmap(NULL, samples_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                             -1, 0);
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        run.recorders[i] = (struct recorder) {samples + i * MAX_SAMPLES, 0, 0x9E3779B97F4A7C15ULL + i};
+    }
+    uint64_t start = now();
+    scenario->run(&run);
+    run.seconds = (now() - start) / 1e9;
+
+    // Gather every thread's samples after the first thread's.
+    size_t count = run.recorders[0].count;
+    for (int i = 1; i < THREAD_COUNT; i++) {
+        memmove(samples + count, run.recorders[i].samples, run.recorders[i].count * sizeof(uint32_t));
+        count += run.recorders[i].count;
+    }
+    qsort(samples, count, sizeof(uint32_t), compare_samples);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-23s %12.0f %8u %8u %12ld %12zu %12zu\n", scenario->name, count / run.seconds,
+           count ? samples[count / 2] : 0, count ? samples[count * 99 / 100] : 0, usage.ru_maxrss, run.internal,
+           run.external);
+    munmap(samples, samples_length);
+}
+
+int main(int argc, char** argv) {
+    // stdio would otherwise allocate its buffer through the allocator being measured.
+    setvbuf(stdout, NULL, _IONBF, 0);
+    printf("%-23s %12s %8s %8s %12s %12s %12s\n", "scenario", "ops/sec", "p50 ns", "p99 ns", "peak RSS KiB",
+           "internal", "external");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        int selected = argc == 1;
+        for (int j = 1; j < argc; j++) {
+            selected |= strcmp(argv[j], scenarios[i].name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            run_scenario(&scenarios[i]);
+            exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -6,17 +6,32 @@
  *
  * Written by Darren Chan <darrennchan8@gmail.com>
  */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include "malloc.h"
+#include "memleak.h"
 
 #define sbrk_should(option) assert_sbrk_should(option, -1)
 #define INITIALIZE 0
 #define DECREASE 1
 #define STAY_THE_SAME 2
 #define INCREASE 3
+#define THREAD_COUNT 8
+#define THREAD_ITERATIONS 20000
+#define REMOTE_FREE_OBJECTS 1000
+#define FREE_ONLY_OBJECTS 64
+// The data size of a heap block holding `size` bytes: at least its free links and footer, and a multiple of
+// MALLOC_ALIGNMENT bytes with its header.
+#define block_data_size(size) ((((size) < 24 ? 24 : (size)) + ALLOCATION_META_SIZE + MALLOC_ALIGNMENT - 1) \
+        / MALLOC_ALIGNMENT * MALLOC_ALIGNMENT - ALLOCATION_META_SIZE)
 
 void* previous_sbrk;
 
@@ -118,32 +133,6 @@ void assert_ptr_neq(void* p1, void* p2) {
     assert_that(message, p1 != p2);
 }
 
-/**
- * Adds `block`'s memory leak to `internal` and `external`.
- *
- * @param block The allocation block to calculate the memory leak for.
- * @param internal A pointer to a size_t, for recording the internal memory leak.
- * @param external A pointer to a size_t, for recording the external memory leak.
- */
-void record_memory_leak_for_block(struct allocation_block* block, size_t* internal, size_t* external) {
-    *external += block->free ? block->size : 0;
-    *internal += block->free ? 0 : block->size - block->requested_size;
-}
-
-/**
- * Gets the total memory leak and records to `internal` and `external`.
- *
- * @param internal A pointer to a size_t, for recording the internal memory leak.
- * @param external A pointer to a size_t, for recording the external memory leak.
- */
-void get_total_memory_leak(size_t* internal, size_t* external) {
-    *internal = 0;
-    *external = 0;
-    for (struct allocation_block* block = allocation_head; block; block = block->next) {
-        record_memory_leak_for_block(block, internal, external);
-    }
-}
-
 /**
  * Asserts that the total memory leak is equal to `exp_internal` and `exp_external`.
  *
@@ -154,6 +143,10 @@ void assert_total_memleak_eq(long exp_internal, long exp_external) {
     size_t actual_internal, actual_external;
     get_total_memory_leak(&actual_internal, &actual_external);
     char message[100];
+#ifndef __DEBUG__
+    // Release builds don't record the size that was asked for, so can't tell internal fragmentation apart.
+    exp_internal = -1;
+#endif
     if (exp_internal != -1) {
         sprintf(message, "Expect total internal memory leak to be %lu bytes, got %lu.", exp_internal, actual_internal);
         assert_that(message, exp_internal == actual_internal);
@@ -175,6 +168,10 @@ void assert_memleak_eq(struct allocation_block* block, long exp_internal, long e
     size_t actual_internal = 0, actual_external = 0;
     record_memory_leak_for_block(block, &actual_internal, &actual_external);
     char message[100];
+#ifndef __DEBUG__
+    // Release builds don't record the size that was asked for, so can't tell internal fragmentation apart.
+    exp_internal = -1;
+#endif
     if (exp_internal != -1) {
         sprintf(message, "Expect internal memory leak for %p to be %lu bytes, got %lu.", block, exp_internal, actual_internal);
         assert_that(message, exp_internal == actual_internal);
@@ -197,6 +194,109 @@ void assert_memleak_for_allocation_eq(void* allocation, long exp_internal, long
     assert_memleak_eq(find_allocation_block_for_allocation(allocation), exp_internal, exp_external);
 }
 
+/**
+ * Repeatedly allocates, fills, checks and frees blocks of different sizes, both cached and uncached. Run concurrently from several threads
+ * to test that they don't hand out overlapping blocks.
+ *
+ * @param seed The fill pattern for the calling thread's blocks.
+ * @return NULL if the blocks were never corrupted, or the seed otherwise.
+ */
+void* churn_blocks(void* seed) {
+    char pattern = (char) (long) seed;
+    char* blocks[16] = {NULL};
+    size_t sizes[16] = {0};
+    void* result = NULL;
+    for (int i = 0; i < THREAD_ITERATIONS; i++) {
+        int slot = i % 16;
+        for (size_t j = 0; j < sizes[slot]; j++) {
+            if (blocks[slot][j] != pattern) {
+                result = seed;
+            }
+        }
+        free(blocks[slot]);
+        sizes[slot] = 1 + (i * 7 + (long) seed) % 1000;
+        blocks[slot] = malloc(sizes[slot]);
+        memset(blocks[slot], pattern, sizes[slot]);
+    }
+    for (int slot = 0; slot < 16; slot++) {
+        free(blocks[slot]);
+    }
+    return result;
+}
+
+/**
+ * Allocates FREE_ONLY_OBJECTS slab objects for another thread to free.
+ *
+ * @param objects Where to store the objects.
+ * @return NULL.
+ */
+void* allocate_only(void* objects) {
+    for (int i = 0; i < FREE_ONLY_OBJECTS; i++) {
+        ((void**) objects)[i] = malloc(64);
+    }
+    return NULL;
+}
+
+/**
+ * Frees FREE_ONLY_OBJECTS objects allocated by another thread, without allocating anything itself.
+ *
+ * @param objects The objects to free.
+ * @return NULL.
+ */
+void* free_only(void* objects) {
+    for (int i = 0; i < FREE_ONLY_OBJECTS; i++) {
+        free(((void**) objects)[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Checks that `malloc_iterate` reports the heap blocks in address order, as a `malloc_iterate` callback.
+ *
+ * @param ptr The block's data.
+ * @param size The block's data size.
+ * @param requested_size The size that was asked for.
+ * @param free Whether the block is free.
+ * @param context A pointer to the block expected next, which is moved on to the one after it.
+ */
+void check_walked_block(void* ptr, size_t size, size_t requested_size, int free, void* context) {
+    struct allocation_block** expected = context;
+    if (*expected && ptr == (char*) *expected + ALLOCATION_META_SIZE && size == allocation_block_size(*expected)
+            && free == allocation_block_is_free(*expected) && (!free || !requested_size)) {
+        *expected = next_allocation_block(*expected);
+    } else {
+        // Never matches again, so that the walk is reported as out of order.
+        *expected = (struct allocation_block*) -1;
+    }
+}
+
+/**
+ * Slab objects allocated by one thread for another to free.
+ */
+struct remote_free_worker {
+    pthread_barrier_t barrier;
+    void* objects[2][REMOTE_FREE_OBJECTS];
+};
+
+/**
+ * Allocates two rounds of REMOTE_FREE_OBJECTS slab objects, waiting for the main thread to check on each round twice:
+ * once allocated, and once freed.
+ *
+ * @param argument The remote_free_worker.
+ * @return NULL.
+ */
+void* allocate_for_remote_free(void* argument) {
+    struct remote_free_worker* worker = argument;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < REMOTE_FREE_OBJECTS; i++) {
+            worker->objects[round][i] = malloc(32);
+        }
+        pthread_barrier_wait(&worker->barrier);
+        pthread_barrier_wait(&worker->barrier);
+    }
+    return NULL;
+}
+
 /**
  * Prints the total memory leak (internal + external).
  */
@@ -207,11 +307,67 @@ void print_total_memory_leak() {
 }
 
 int main() {
+    // stdio would otherwise allocate its buffer through our malloc in the middle of the tests.
+    setvbuf(stdout, NULL, _IONBF, 0);
+    // The tests below check exactly how blocks are laid out on the heap, so keep freed blocks out of the thread cache
+    // and small allocations out of slabs, and grow the heap by exactly what each allocation needs.
+    mallopt(M_TCACHE_COUNT, 0);
+    mallopt(M_SLAB_MAX_SIZE, 0);
+    mallopt(M_HEAP_GROWTH, 0);
+
+    // Tests that the heap can grow inside a reserved huge page region instead of with sbrk. The region has to be
+    // chosen before the heap is first used, so this runs in a child.
+    pid_t child = fork();
+    if (child == 0) {
+        assert_eq(1, mallopt(M_HEAP_RESERVE, 64));
+        assert_eq(1, mallopt(M_HUGEPAGE_THRESHOLD, 4 * 1024 * 1024));
+        char* initialBreak = sbrk(0);
+        char* regionBlock = malloc(1000);
+        assert_eq(0, mallopt(M_HEAP_RESERVE, 128));
+        assert_that("The heap should start at a huge page.", (uintptr_t) allocation_head % (2 * 1024 * 1024) < MALLOC_ALIGNMENT);
+        // Only the first huge page of the region is committed, and the rest stays reserved without access.
+        uintptr_t committedEnd = ((uintptr_t) allocation_head & ~(uintptr_t) (2 * 1024 * 1024 - 1)) + 2 * 1024 * 1024;
+        FILE* maps = fopen("/proc/self/maps", "r");
+        char line[256];
+        int reserved = 0;
+        while (fgets(line, sizeof(line), maps)) {
+            uintptr_t start;
+            char permissions[5];
+            if (sscanf(line, "%lx-%*x %4s", &start, permissions) == 2 && start == committedEnd) {
+                reserved = strcmp(permissions, "---p") == 0;
+            }
+        }
+        fclose(maps);
+        assert_that("The region beyond the heap should only be reserved.", reserved);
+        mallopt(M_MMAP_THRESHOLD, 128 * 1024 * 1024);
+        char* regionTail = malloc(32 * 1024 * 1024);
+        memset(regionTail, 'h', 32 * 1024 * 1024);
+        free(regionTail);
+        char* regionCleared = calloc(32 * 1024 * 1024, 1);
+        for (int i = 0; i < 32 * 1024 * 1024; i += 4096) {
+            assert_eq(0, regionCleared[i]);
+        }
+        // The region is full, so the next heap block falls back to a mapping of its own.
+        char* beyondRegion = malloc(64 * 1024 * 1024);
+        assert_ptr_neq(NULL, beyondRegion);
+        assert_that("A heap block beyond the region should be mapped.", (void*) beyondRegion < (void*) allocation_head
+                    || (void*) beyondRegion > (void*) allocation_tail);
+        memset(beyondRegion, 'm', 64 * 1024 * 1024);
+        free(beyondRegion);
+        assert_ptr_eq(initialBreak, sbrk(0));
+        free(regionCleared);
+        free(regionBlock);
+        _exit(0);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    assert_that("The heap region child should pass.", WIFEXITED(status) && WEXITSTATUS(status) == 0);
     sbrk_should(INITIALIZE);
 
-    // Tests that alignment is 8 bytes.
+    // Tests that alignment is 16 bytes.
     char* oneChar = calloc(1, sizeof(char));
     sbrk_should(INCREASE);
+    assert_that("Allocations should be aligned to 16 bytes.", (uintptr_t) oneChar % 16 == 0);
 
     char* twoChars = realloc(oneChar, 8 * sizeof(char));
     sbrk_should(STAY_THE_SAME);
@@ -253,17 +409,20 @@ int main() {
     char* tenChars = realloc(numbersToTwenty, 10 * sizeof(char));
     assert_ptr_eq(numbersToTwenty, tenChars);
     sbrk_should(STAY_THE_SAME);
-    int* numbersToSix = calloc(6, sizeof(int));
+    // The remainder of the split holds whatever is left after the new block's meta information.
+    size_t tenCharsSize = allocation_block_size(find_allocation_block_for_allocation(tenChars));
+    int remainingNumbersCount = (int) ((20 * sizeof(int) - tenCharsSize - ALLOCATION_META_SIZE) / sizeof(int));
+    int* remainingNumbers = calloc(remainingNumbersCount, sizeof(int));
     sbrk_should(STAY_THE_SAME);
-    assert_ptr_neq(numbersToSix, numbersToTwenty);
-    for (int i = 1; i < 6; i++) {
+    assert_ptr_neq(remainingNumbers, numbersToTwenty);
+    for (int i = 1; i < remainingNumbersCount; i++) {
         // Ensures that calloc correctly splits the block contiguously and aligns.
-        *((int*)(tenChars + 16 + sizeof(struct allocation_block) / sizeof(char)) + i) = i;
+        *((int*)(tenChars + tenCharsSize + ALLOCATION_META_SIZE / sizeof(char)) + i) = i;
     }
-    for (int i = 0; i < 6; i++) {
-        assert_eq(i, numbersToSix[i]);
+    for (int i = 0; i < remainingNumbersCount; i++) {
+        assert_eq(i, remainingNumbers[i]);
     }
-    free(numbersToSix);
+    free(remainingNumbers);
     free(tenChars);
     int* numbersToTwentyAgain = malloc(20 * sizeof(int));
     assert_ptr_eq(tenChars, numbersToTwentyAgain);
@@ -273,79 +432,701 @@ int main() {
     free(name);
     free(eightChars);
     free(numbersToTwentyAgain);
-    char* a = malloc(16);
-    char* b = malloc(8);
-    char* c = malloc(8);
-    char* d = malloc(8);
+    char* a = malloc(64);
+    char* b = malloc(32);
+    char* c = malloc(32);
+    char* d = malloc(32);
     free(a);
     free(c);
-    char* e = malloc(8);
+    char* e = malloc(32);
     assert_ptr_eq(c, e);
     assert_ptr_neq(a, e);
     free(b);
     free(d);
     free(e);
-    sbrk_should(STAY_THE_SAME);
+    // d doesn't fit in what's left of the freed blocks above.
+    sbrk_should(INCREASE);
 
     // Tests that allocating uses the tail if free, even if we need to increment sbrk.
-    long* bigArray = calloc(25, sizeof(long));
+    long* bigArray = calloc(30, sizeof(long));
     sbrk_should(INCREASE);
-    long* bigArray2 = realloc(bigArray, 26 * sizeof(long));
-    assert_sbrk_should(INCREASE, sizeof(long));
+    long* bigArray2 = realloc(bigArray, 32 * sizeof(long));
+    assert_sbrk_should(INCREASE, 2 * sizeof(long));
     assert_ptr_eq(bigArray, bigArray2);
     free(bigArray2);
-    long* bigArray3 = calloc(27, sizeof(long));
-    assert_sbrk_should(INCREASE, sizeof(long));
+    long* bigArray3 = calloc(34, sizeof(long));
+    assert_sbrk_should(INCREASE, 2 * sizeof(long));
     assert_ptr_eq(bigArray, bigArray2);
     assert_total_memleak_eq(0, 0);
 
     // Test for expected individual memory leaks.
     char* block1 = realloc(bigArray3, sizeof(char));
     assert_ptr_eq(bigArray3, block1);
-    assert_memleak_for_allocation_eq(block1, 7, 0);
+    // Blocks hold at least 32 bytes in instrumented builds (24 in release ones), so that they can be linked into a bin
+    // once freed and the next block stays aligned to 16 bytes.
+    assert_memleak_for_allocation_eq(block1, 31, 0);
     char* block2 = realloc(block1, sizeof(char) * 2);
     assert_ptr_eq(block1, block2);
-    assert_memleak_for_allocation_eq(block2, 6, 0);
+    assert_memleak_for_allocation_eq(block2, 30, 0);
     free(block2);
-    char* block3 = calloc(8, sizeof(char));
+    char* block3 = calloc(32, sizeof(char));
     assert_memleak_for_allocation_eq(block3, 0, 0);
-    char* block4 = calloc(7, sizeof(char));
+    char* block4 = calloc(31, sizeof(char));
     assert_ptr_neq(block3, block4);
     assert_memleak_for_allocation_eq(block4, 1, 0);
     free(block3);
-    assert_memleak_for_allocation_eq(block3, 0, 8);
-    char* block5 = malloc(16 * sizeof(char));
+    assert_memleak_for_allocation_eq(block3, 0, block_data_size(32));
+    char* block5 = malloc(48 * sizeof(char));
     assert_ptr_neq(block4, block5);
     assert_memleak_for_allocation_eq(block5, 0, 0);
     free(block4);
-    assert_memleak_eq(allocation_head, 0, 16 + sizeof(struct allocation_block));
+    assert_memleak_eq(allocation_head, 0, 2 * block_data_size(32) + ALLOCATION_META_SIZE);
     free(block5);
     char* block6 = malloc(5 * sizeof(char));
-    assert_ptr_eq(allocation_head + 1, block6);
-    assert_memleak_eq(allocation_head, 3, 0);
+    assert_ptr_eq((char*) allocation_head + ALLOCATION_META_SIZE, block6);
+    assert_memleak_eq(allocation_head, 27, 0);
     // Reallocate rest of space perfectly to start out with clean slate when calculating total memory leak.
-    long* allocateAllOfSpace = realloc(block6, 27 * sizeof(long));
+    long* allocateAllOfSpace = realloc(block6, 34 * sizeof(long));
     sbrk_should(STAY_THE_SAME);
 
     // Test for expected total memory leaks.
     char* cArr = calloc(9, sizeof(char));
     sbrk_should(INCREASE);
-    assert_total_memleak_eq(7, 0);
+    assert_total_memleak_eq(23, 0);
     char* cArr2 = realloc(cArr, sizeof(char));
     sbrk_should(STAY_THE_SAME);
     assert_ptr_eq(cArr, cArr2);
-    assert_total_memleak_eq(15, 0);
+    assert_total_memleak_eq(31, 0);
     char* cArr3 = calloc(4, sizeof(char));
     sbrk_should(INCREASE);
     assert_ptr_neq(cArr2, cArr3);
-    assert_total_memleak_eq(15 + 4, 0);
-    char* cArr4 = realloc(cArr2, 24 * sizeof(char));
+    assert_total_memleak_eq(31 + 28, 0);
+    char* cArr4 = realloc(cArr2, 48 * sizeof(char));
     sbrk_should(INCREASE);
     assert_ptr_neq(cArr2, cArr4);
-    assert_total_memleak_eq(4, 16);
+    assert_total_memleak_eq(28, block_data_size(1));
     char* cArr5 = realloc(cArr3, 5 * sizeof(char));
     sbrk_should(STAY_THE_SAME);
     assert_ptr_eq(cArr3, cArr5);
-    assert_total_memleak_eq(3, 16);
+    assert_total_memleak_eq(27, block_data_size(1));
     print_total_memory_leak();
+
+    // Tests that lookups through the log-spaced bins still pick the best fit.
+    char* largeBlock = malloc(2000);
+    char* separator = malloc(48);
+    char* mediumBlock = malloc(1200);
+    char* separator2 = malloc(48);
+    // The separators keep the freed blocks from merging, so they must be heap blocks of their own.
+    assert_ptr_neq(NULL, find_allocation_block_for_allocation(separator));
+    assert_ptr_neq(NULL, find_allocation_block_for_allocation(separator2));
+    free(largeBlock);
+    free(mediumBlock);
+    char* bestFit = malloc(1100);
+    assert_ptr_eq(mediumBlock, bestFit);
+    char* nextBinFit = malloc(1500);
+    assert_ptr_eq(largeBlock, nextBinFit);
+    sbrk_should(INCREASE);
+
+    // Tests that pointers which weren't returned by `*alloc` and double frees are detected and ignored.
+    char* interiorPointer = bestFit + 8;
+    assert_ptr_eq(NULL, find_allocation_block_for_allocation(interiorPointer));
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wfree-nonheap-object"
+    free(interiorPointer);
+#pragma GCC diagnostic pop
+    assert_memleak_for_allocation_eq(bestFit, 4, 0);
+    free(bestFit);
+    free(bestFit);
+    char* bestFitAgain = malloc(1100);
+    assert_ptr_eq(bestFit, bestFitAgain);
+    char* notBestFit = malloc(1100);
+    assert_ptr_neq(bestFit, notBestFit);
+
+    // Tests that a free tail is given back to the OS once it's bigger than the trim threshold, or on malloc_trim.
+    mallopt(M_MMAP_THRESHOLD, 1024 * 1024);
+    char* tail = malloc(100 * 1024);
+    sbrk_should(INCREASE);
+    free(tail);
+    sbrk_should(STAY_THE_SAME);
+    char* biggerTail = malloc(200 * 1024);
+    sbrk_should(INCREASE);
+    free(biggerTail);
+    sbrk_should(DECREASE);
+    // Trimming keeps a free tail of the smallest block size, which the next allocation extends.
+    char* smallTail = malloc(64 * 1024);
+    assert_sbrk_should(INCREASE, block_data_size(64 * 1024) - block_data_size(0));
+    free(smallTail);
+    sbrk_should(STAY_THE_SAME);
+    assert_eq(1, malloc_trim(0));
+    assert_sbrk_should(DECREASE, block_data_size(64 * 1024) - block_data_size(0));
+    assert_eq(0, malloc_trim(0));
+    sbrk_should(STAY_THE_SAME);
+    mallopt(M_MMAP_THRESHOLD, 128 * 1024);
+
+    // Tests that small objects are packed into slabs without headers, off the heap.
+    mallopt(M_SLAB_MAX_SIZE, 256);
+    char* slabObjects[4];
+    for (int i = 0; i < 4; i++) {
+        slabObjects[i] = malloc(32);
+    }
+    sbrk_should(STAY_THE_SAME);
+    for (int i = 1; i < 4; i++) {
+        assert_ptr_eq(slabObjects[i - 1] + 32, slabObjects[i]);
+    }
+    char* slabInteriorPointer = slabObjects[2] + 8;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wfree-nonheap-object"
+    free(slabInteriorPointer);
+#pragma GCC diagnostic pop
+    free(slabObjects[1]);
+    free(slabObjects[1]);
+    char* slabObject = malloc(20);
+    assert_ptr_eq(slabObjects[1], slabObject);
+    char* nextSlabObject = malloc(32);
+    assert_ptr_eq(slabObjects[3] + 32, nextSlabObject);
+    sprintf(slabObject, "Slab");
+    assert_ptr_eq(slabObject, realloc(slabObject, 8));
+    char* movedSlabObject = realloc(slabObject, 100);
+    assert_ptr_neq(slabObject, movedSlabObject);
+    assert_that("Realloc should keep the slab object's data.", strcmp(movedSlabObject, "Slab") == 0);
+    free(movedSlabObject);
+    free(nextSlabObject);
+    free(slabObjects[0]);
+    free(slabObjects[2]);
+    free(slabObjects[3]);
+    sbrk_should(STAY_THE_SAME);
+
+    // Tests that freed small blocks go through the thread cache.
+    mallopt(M_TCACHE_COUNT, 16);
+    char* cachedSlabObject = malloc(24);
+    free(cachedSlabObject);
+    assert_ptr_eq(cachedSlabObject, malloc(24));
+    free(cachedSlabObject);
+    char* cached = malloc(300);
+    size_t cachedSize = allocation_block_size(find_allocation_block_for_allocation(cached));
+    free(cached);
+    assert_ptr_eq(NULL, find_allocation_block_for_allocation(cached));
+    char* cachedAgain = malloc(cachedSize);
+    assert_ptr_eq(cached, cachedAgain);
+    free(cachedAgain);
+    // A thread that only frees still flushes its cache when it exits. The objects come from a thread that has exited,
+    // so that no thread owns their slabs and frees into them are immediate.
+    struct malloc_counters freeOnlyCounters;
+    malloc_get_counters(&freeOnlyCounters);
+    size_t inUseObjects = freeOnlyCounters.size_class_objects[64 / MALLOC_ALIGNMENT - 1];
+    void* freedElsewhere[FREE_ONLY_OBJECTS];
+    pthread_t freeOnlyThread;
+    pthread_create(&freeOnlyThread, NULL, allocate_only, freedElsewhere);
+    pthread_join(freeOnlyThread, NULL);
+    pthread_create(&freeOnlyThread, NULL, free_only, freedElsewhere);
+    pthread_join(freeOnlyThread, NULL);
+    malloc_get_counters(&freeOnlyCounters);
+    assert_eq(inUseObjects, freeOnlyCounters.size_class_objects[64 / MALLOC_ALIGNMENT - 1]);
+
+    // Tests that concurrent threads never hand out the same block twice.
+    pthread_t threads[THREAD_COUNT];
+    for (long i = 0; i < THREAD_COUNT; i++) {
+        pthread_create(&threads[i], NULL, churn_blocks, (void*) (i + 1));
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        void* result;
+        pthread_join(threads[i], &result);
+        assert_ptr_eq(NULL, result);
+    }
+
+    // Tests that large allocations get their own mapping, which is returned to the OS when freed.
+    sbrk_should(INITIALIZE);
+    char* mapped = malloc(256 * 1024);
+    sbrk_should(STAY_THE_SAME);
+    memset(mapped, 'm', 256 * 1024);
+    char* remapped = realloc(mapped, 1024 * 1024);
+    sbrk_should(STAY_THE_SAME);
+    assert_that("Realloc should keep the mapped data.", remapped[256 * 1024 - 1] == 'm');
+    void* mapping = find_allocation_block_for_allocation(remapped);
+    assert_ptr_neq(NULL, mapping);
+    free(remapped);
+    unsigned char residency;
+    assert_that("Free should unmap large allocations.", mincore(mapping, getpagesize(), &residency) == -1);
+    mallopt(M_MMAP_THRESHOLD, 512 * 1024);
+    char* unmapped = malloc(256 * 1024);
+    assert_that("Allocations below the threshold should come from the heap.",
+                (void*) allocation_head < (void*) unmapped && (void*) unmapped < sbrk(0));
+    free(unmapped);
+    // Shrinking a heap block that is now past the threshold moves it into a mapping of the new size.
+    char* shrunk = malloc(400 * 1024);
+    memset(shrunk, 's', 400 * 1024);
+    mallopt(M_MMAP_THRESHOLD, 128 * 1024);
+    shrunk = realloc(shrunk, 200 * 1024);
+    assert_that("Shrinking past the threshold should map the block.",
+                (void*) shrunk < (void*) allocation_head || sbrk(0) <= (void*) shrunk);
+    assert_that("Shrinking into a mapping should keep the data.", shrunk[200 * 1024 - 1] == 's');
+    free(shrunk);
+
+    // Tests that the aligned family aligns blocks and gives the padding in front of them back to the heap.
+    mallopt(M_TCACHE_COUNT, 0);
+    mallopt(M_SLAB_MAX_SIZE, 0);
+    char* pageAligned = memalign(4096, 100);
+    assert_that("memalign should align to 4096 bytes.", (uintptr_t) pageAligned % 4096 == 0);
+    struct allocation_block* padding = allocation_head;
+    while (next_allocation_block(padding) != find_allocation_block_for_allocation(pageAligned)) {
+        padding = next_allocation_block(padding);
+    }
+    assert_that("The padding before an aligned block should be free.", allocation_block_is_free(padding));
+    void* posixAligned = NULL;
+    assert_eq(EINVAL, posix_memalign(&posixAligned, 24, 64));
+    assert_eq(EINVAL, posix_memalign(&posixAligned, 0, 64));
+    assert_eq(0, posix_memalign(&posixAligned, 64, 64));
+    assert_that("posix_memalign should align to 64 bytes.", (uintptr_t) posixAligned % 64 == 0);
+    char* cacheLineAligned = aligned_alloc(128, 256);
+    assert_that("aligned_alloc should align to 128 bytes.", (uintptr_t) cacheLineAligned % 128 == 0);
+    assert_ptr_eq(NULL, aligned_alloc(48, 256));
+    char* pages = pvalloc(5000);
+    assert_that("pvalloc should align to a page.", (uintptr_t) pages % getpagesize() == 0);
+    assert_that("pvalloc should round up to whole pages.",
+                allocation_block_size(find_allocation_block_for_allocation(pages)) >= 2 * getpagesize());
+    char* emptyPage = pvalloc(0);
+    assert_that("pvalloc should give an empty allocation a whole page.", emptyPage
+                && allocation_block_size(find_allocation_block_for_allocation(emptyPage)) >= (size_t) getpagesize());
+    free(emptyPage);
+    char* page = valloc(1);
+    assert_that("valloc should align to a page.", (uintptr_t) page % getpagesize() == 0);
+    free(pageAligned);
+    free(posixAligned);
+    free(cacheLineAligned);
+    free(pages);
+    free(page);
+    void* alignedChurn[64];
+    for (int i = 0; i < 64; i++) {
+        posix_memalign(&alignedChurn[i], 64 << (i % 4), 100 + 40 * i);
+    }
+    for (int i = 0; i < 64; i += 2) {
+        free(alignedChurn[i]);
+        posix_memalign(&alignedChurn[i], 128, 300);
+    }
+    int adjacentFree = 0;
+    for (struct allocation_block* block = allocation_head; block != allocation_tail;
+            block = next_allocation_block(block)) {
+        adjacentFree += allocation_block_is_free(block) && allocation_block_is_free(next_allocation_block(block));
+    }
+    assert_eq(0, adjacentFree);
+    for (int i = 0; i < 64; i++) {
+        free(alignedChurn[i]);
+    }
+    sbrk_should(INITIALIZE);
+    void* mappedAligned = NULL;
+    assert_eq(0, posix_memalign(&mappedAligned, 4096, 1024 * 1024));
+    char* hugeAligned = memalign(2 * 1024 * 1024, 256 * 1024);
+    sbrk_should(STAY_THE_SAME);
+    assert_that("Big aligned allocations should be aligned.",
+                (uintptr_t) mappedAligned % 4096 == 0 && (uintptr_t) hugeAligned % (2 * 1024 * 1024) == 0);
+    memset(mappedAligned, 'a', 1024 * 1024);
+    memset(hugeAligned, 'h', 256 * 1024);
+    char* remappedAligned = realloc(mappedAligned, 2 * 1024 * 1024);
+    assert_that("Realloc should keep the mapped aligned data.", remappedAligned[1024 * 1024 - 1] == 'a');
+    assert_that("Big aligned allocations should be mapped.", find_allocation_block_for_allocation(remappedAligned)
+                && find_allocation_block_for_allocation(hugeAligned));
+    free(remappedAligned);
+    free(hugeAligned);
+    assert_that("Free should unmap big aligned allocations.", mincore(remappedAligned, 4096, &residency) == -1
+                && mincore(hugeAligned, 4096, &residency) == -1);
+
+    // Tests that the running counters agree with a walk of the heap.
+    size_t internal, external, largest = 0;
+    get_total_memory_leak(&internal, &external);
+    for (struct allocation_block* block = allocation_head; block; block = next_allocation_block(block)) {
+        if (allocation_block_is_free(block) && allocation_block_size(block) > largest) {
+            largest = allocation_block_size(block);
+        }
+    }
+    struct malloc_counters counters;
+    malloc_get_counters(&counters);
+    assert_eq(external, counters.heap_free);
+    assert_eq(largest, counters.largest_free_block);
+    struct mallinfo2 info = mallinfo2();
+    assert_that("In use and free bytes should add up to the arena.",
+                info.uordblks + info.fordblks + info.fsmblks == info.arena);
+    char* usable = malloc(100);
+    assert_eq(block_data_size(100), malloc_usable_size(usable));
+    free(usable);
+    assert_eq(0, malloc_usable_size(usable));
+    char* counted = malloc(256 * 1024);
+    assert_eq(info.hblks + 1, mallinfo2().hblks);
+    free(counted);
+    assert_eq(info.hblks, mallinfo2().hblks);
+    mallopt(M_SLAB_MAX_SIZE, 256);
+    char* countedSlabObject = malloc(20);
+    assert_eq(32, malloc_usable_size(countedSlabObject));
+    malloc_get_counters(&counters);
+    assert_that("The slab object should be counted in its size class.", counters.size_class_objects[1] > 0);
+    size_t slabObjectsInUse = counters.size_class_objects[1];
+    free(countedSlabObject);
+    malloc_get_counters(&counters);
+    assert_eq(slabObjectsInUse - 1, counters.size_class_objects[1]);
+    malloc_stats();
+
+    // Tests that calloc clears reused memory, even where the heap was trimmed and regrown, and rejects overflows.
+    mallopt(M_SLAB_MAX_SIZE, 0);
+    errno = 0;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Walloc-size-larger-than="
+    assert_ptr_eq(NULL, calloc(SIZE_MAX / 2, 4));
+#pragma GCC diagnostic pop
+    assert_eq(ENOMEM, errno);
+    char* reused = malloc(1000);
+    char* reusedSeparator = malloc(48);
+    memset(reused, 'r', 1000);
+    free(reused);
+    char* cleared = calloc(1000, 1);
+    assert_ptr_eq(reused, cleared);
+    for (int i = 0; i < 1000; i++) {
+        assert_eq(0, cleared[i]);
+    }
+    mallopt(M_MMAP_THRESHOLD, 1024 * 1024);
+    sbrk_should(INITIALIZE);
+    char* trimmed = malloc(200 * 1024);
+    memset(trimmed, 't', 200 * 1024);
+    free(trimmed);
+    sbrk_should(DECREASE);
+    char* regrown = calloc(200 * 1024, 1);
+    sbrk_should(INCREASE);
+    for (int i = 0; i < 200 * 1024; i++) {
+        assert_eq(0, regrown[i]);
+    }
+    free(regrown);
+    free(cleared);
+    free(reusedSeparator);
+    mallopt(M_MMAP_THRESHOLD, 128 * 1024);
+
+    // Tests that a buffer that has to move when grown gets headroom, and keeps it when shrunk a little.
+    char* bufferLeftSeparator = malloc(1024);
+    char* buffer = malloc(1024);
+    char* bufferRightSeparator = malloc(1024);
+    size_t capacity = malloc_usable_size(buffer);
+    char* grownBuffer = realloc(buffer, capacity + 1);
+    assert_ptr_neq(buffer, grownBuffer);
+    assert_that("Realloc should leave headroom when moving.", malloc_usable_size(grownBuffer) >= capacity * 3 / 2);
+    capacity = malloc_usable_size(grownBuffer);
+    assert_ptr_eq(grownBuffer, realloc(grownBuffer, capacity));
+    assert_ptr_eq(grownBuffer, realloc(grownBuffer, capacity - capacity / 4));
+    assert_eq((int) capacity, (int) malloc_usable_size(grownBuffer));
+    free(grownBuffer);
+    free(bufferLeftSeparator);
+    free(bufferRightSeparator);
+
+    // Tests that realloc moves the data into a free block on the left when that is the only room.
+    char* leftSeparator = malloc(1000);
+    char* left = malloc(1000);
+    char* middle = malloc(1000);
+    char* rightSeparator = malloc(1000);
+    memset(middle, 'm', 1000);
+    free(left);
+    char* merged = realloc(middle, 1500);
+    assert_ptr_eq(left, merged);
+    for (int i = 0; i < 1000; i++) {
+        assert_eq('m', merged[i]);
+    }
+    free(merged);
+    free(leftSeparator);
+    free(rightSeparator);
+
+    // Tests that big free blocks are found by true best fit, even when many blocks of close sizes are free, and that
+    // ties go to the lowest address.
+    char* bigBlocks[20];
+    char* bigSeparators[20];
+    for (int i = 0; i < 20; i++) {
+        bigBlocks[i] = malloc(8192 + 64 * i);
+        bigSeparators[i] = malloc(1000);
+    }
+    for (int i = 0; i < 20; i++) {
+        free(bigBlocks[i]);
+    }
+    char* bestBigFit = malloc(8192 + 64 * 3);
+    assert_ptr_eq(bigBlocks[3], bestBigFit);
+    free(bestBigFit);
+    char* lowerTwin = malloc(12000);
+    char* lowerTwinSeparator = malloc(1000);
+    char* higherTwin = malloc(12000);
+    char* higherTwinSeparator = malloc(1000);
+    free(higherTwin);
+    free(lowerTwin);
+    char* twin = malloc(12000);
+    assert_that("Ties should go to the lowest address.", twin == (lowerTwin < higherTwin ? lowerTwin : higherTwin));
+    free(twin);
+    free(lowerTwinSeparator);
+    free(higherTwinSeparator);
+    for (int i = 0; i < 20; i++) {
+        free(bigSeparators[i]);
+    }
+
+    // Tests that batches of blocks are carved out of one region and freed back into one block.
+    void* batch[50];
+    assert_eq(50, (int) malloc_batch(100, 50, batch));
+    for (int i = 0; i < 50; i++) {
+        memset(batch[i], 'b', 100);
+    }
+    for (int i = 1; i < 50; i++) {
+        assert_ptr_eq((char*) batch[i - 1] + malloc_usable_size(batch[i - 1]) + ALLOCATION_META_SIZE, batch[i]);
+    }
+    size_t batchSize = (char*) batch[49] + malloc_usable_size(batch[49]) - (char*) batch[0];
+    void* batchFirst = batch[0];
+    for (int i = 0; i < 25; i++) {
+        void* swapped = batch[i];
+        batch[i] = batch[49 - i];
+        batch[49 - i] = swapped;
+    }
+    void* repeated[52];
+    memcpy(repeated, batch, sizeof(batch));
+    repeated[50] = batchFirst;
+    repeated[51] = NULL;
+    free_batch(repeated, 52);
+    malloc_get_counters(&counters);
+    assert_that("Freeing a batch should merge it into one block.", counters.largest_free_block >= batchSize);
+    mallopt(M_SLAB_MAX_SIZE, 256);
+    void* slabBatch[10];
+    assert_eq(10, (int) malloc_batch(24, 10, slabBatch));
+    for (int i = 0; i < 10; i++) {
+        assert_eq(32, (int) malloc_usable_size(slabBatch[i]));
+    }
+    free_batch(slabBatch, 10);
+    mallopt(M_SLAB_MAX_SIZE, 0);
+
+    // Tests that sized frees release blocks, and that in instrumented builds a size that doesn't match the request is
+    // caught and ignored.
+    char* sized = malloc(300);
+#ifdef __DEBUG__
+    free_sized(sized, 200);
+    assert_that("A mismatched sized free should be ignored.", malloc_usable_size(sized) >= 300);
+#endif
+    free_sized(sized, 300);
+    assert_eq(0, (int) malloc_usable_size(sized));
+    char* alignedSized = aligned_alloc(256, 1000);
+    free_aligned_sized(alignedSized, 256, 1000);
+    assert_eq(0, (int) malloc_usable_size(alignedSized));
+    mallopt(M_SLAB_MAX_SIZE, 256);
+    char* sizedSlabObject = malloc(20);
+    malloc_get_counters(&counters);
+    size_t sizedSlabObjects = counters.size_class_objects[1];
+    free_sized(sizedSlabObject, 20);
+    malloc_get_counters(&counters);
+    assert_eq((int) sizedSlabObjects - 1, (int) counters.size_class_objects[1]);
+    mallopt(M_SLAB_MAX_SIZE, 0);
+
+    // Tests that arena objects are bumped out of heap chunks, ignored by free, and all given back at once.
+    malloc_get_counters(&counters);
+    size_t heapInUse = counters.heap_in_use;
+    struct arena* arena = arena_create();
+    char* arenaObject = arena_malloc(arena, 24);
+    char* nextArenaObject = arena_malloc(arena, 24);
+    assert_that("Arena objects should be aligned to 16 bytes.",
+                (uintptr_t) arenaObject % 16 == 0 && (uintptr_t) nextArenaObject % 16 == 0);
+    assert_that("Arena objects should be bumped.",
+                nextArenaObject > arenaObject && nextArenaObject - arenaObject <= 24 + 2 * ALLOCATION_META_SIZE);
+    free(arenaObject);
+    assert_eq(0, (int) malloc_usable_size(arenaObject));
+    errno = 0;
+    assert_ptr_eq(NULL, realloc(nextArenaObject, 100));
+    assert_eq(EINVAL, errno);
+    for (int i = 0; i < 1000; i++) {
+        memset(arena_malloc(arena, 1000), 'a', 1000);
+    }
+    char* bigArenaObject = arena_malloc(arena, 200 * 1024);
+    memset(bigArenaObject, 'a', 200 * 1024);
+    malloc_get_counters(&counters);
+    assert_that("Arena chunks should come from the heap.", counters.heap_in_use > heapInUse + 1200 * 1000);
+    arena_reset(arena);
+    malloc_get_counters(&counters);
+    assert_that("Resetting should give back all but one chunk.", counters.heap_in_use < heapInUse + 100 * 1024);
+    assert_ptr_eq(arenaObject, arena_malloc(arena, 24));
+    arena_destroy(arena);
+    malloc_get_counters(&counters);
+    // Freeing can leave the free space split differently, which only changes how many headers there are.
+    assert_that("Destroying should give back every chunk.",
+                counters.heap_in_use <= heapInUse + 4 * ALLOCATION_META_SIZE);
+
+    // Tests that the heap profiler samples allocations with their stacks, and writes the live ones in pprof's format.
+    static char profile[64 * 1024];
+    assert_eq(1, mallopt(M_PROFILE_RATE, 1));
+    char* sampled = malloc(1000);
+    char* sampledSmall = malloc(48);
+    char* sampledMapped = malloc(300 * 1024);
+    char* sampledAligned = memalign(64, 2000);
+    sampled = realloc(sampled, 3000);
+    assert_eq(1, mallopt(M_PROFILE_RATE, 0));
+    assert_eq(1, malloc_profile_dump("assign3.heap"));
+    int profileFd = open("assign3.heap", O_RDONLY);
+    profile[read(profileFd, profile, sizeof(profile) - 1)] = '\0';
+    close(profileFd);
+    assert_that("The profile should count the live samples.",
+                strstr(profile, "heap profile: 4: 312248 [4: 312248] @ heap_v2/1\n") == profile);
+    assert_that("The profile should have each sample's stack.", strstr(profile, "\n1: 3000 [1: 3000] @ 0x") != NULL);
+    assert_that("The profile should sample aligned allocations.", strstr(profile, "\n1: 2000 [1: 2000] @ 0x") != NULL);
+    assert_that("The profile should have the mappings.", strstr(profile, "\nMAPPED_LIBRARIES:\n") != NULL);
+    free_sized(sampledSmall, 48);
+    free(sampledMapped);
+    free(sampledAligned);
+    free(sampled);
+    assert_eq(1, malloc_profile_dump("assign3.heap"));
+    profileFd = open("assign3.heap", O_RDONLY);
+    profile[read(profileFd, profile, sizeof(profile) - 1)] = '\0';
+    close(profileFd);
+    unlink("assign3.heap");
+    assert_that("Freed samples should leave the profile.",
+                strstr(profile, "heap profile: 0: 0 [0: 0] @ heap_v2/1\n") == profile);
+
+    // Tests that the heap grows by doubling steps, carving blocks out of the free tail left behind, and that the free
+    // tail is only trimmed once it is bigger than a step.
+    mallopt(M_HEAP_GROWTH, 64 * 1024);
+    malloc_get_counters(&counters);
+    size_t sbrkCalls = counters.sbrk_calls;
+    sbrk_should(INITIALIZE);
+    char* grown[1000];
+    for (int i = 0; i < 1000; i++) {
+        grown[i] = malloc(1000);
+    }
+    sbrk_should(INCREASE);
+    malloc_get_counters(&counters);
+    // 64 + 128 + 256 + 512 KiB fall just short of the 1000 blocks, so the heap grows at most 5 times.
+    assert_that("The heap should grow a few times in steps.", counters.sbrk_calls - sbrkCalls <= 5);
+    assert_that("Growing should leave a free tail.", allocation_block_is_free(allocation_tail));
+    char* carved = malloc(1000);
+    sbrk_should(STAY_THE_SAME);
+    assert_ptr_eq(allocation_tail, next_allocation_block(find_allocation_block_for_allocation(carved)));
+    free(carved);
+    for (int i = 0; i < 1000; i++) {
+        free(grown[i]);
+    }
+    // The free tail is within the trim threshold of the next step, which is 2 MiB by now.
+    sbrk_should(STAY_THE_SAME);
+    assert_eq(1, malloc_trim(0));
+    sbrk_should(DECREASE);
+    // Trimming by hand starts the steps over.
+    char* regrownHeap = malloc(1000);
+    sbrk_should(INCREASE);
+    assert_that("The heap should grow by the smallest step again.", (char*) sbrk(0) - regrownHeap < 64 * 1024 + 2000);
+    free(regrownHeap);
+    mallopt(M_HEAP_GROWTH, 0);
+
+    // Tests that malloc_iterate walks every heap block in address order, and that malloc_info reports the layout and
+    // fragmentation of the heap without allocating.
+    static char report[1024 * 1024];
+    FILE* reportFile = tmpfile();
+    char* reported = malloc(1000);
+    char* reportedFree = malloc(2000);
+    char* reportedAfter = malloc(1000);
+    free(reportedFree);
+    struct allocation_block* walked = allocation_head;
+    malloc_iterate(check_walked_block, &walked);
+    assert_ptr_eq(NULL, walked);
+    assert_eq(0, malloc_info(0, reportFile));
+    size_t reportLength = pread(fileno(reportFile), report, sizeof(report) - 1, 0);
+    report[reportLength] = '\0';
+    assert_that("The report should fit.", reportLength < sizeof(report) - 1);
+    assert_that("The report should be XML.", strstr(report, "<malloc version=\"1\">\n<heap ") == report);
+    char expectedBlock[100];
+    sprintf(expectedBlock, "<block address=\"%p\" size=\"%zu\" requested=\"0\" free=\"1\"/>", reportedFree,
+            (size_t) block_data_size(2000));
+    assert_that("The report should have the layout.", strstr(report, expectedBlock) != NULL);
+#ifdef __DEBUG__
+    sprintf(expectedBlock, "<block address=\"%p\" size=\"%zu\" requested=\"1000\" free=\"0\"/>", reported,
+            (size_t) block_data_size(1000));
+    assert_that("The report should have the size that was asked for.", strstr(report, expectedBlock) != NULL);
+    assert_that("The report should have the waste.", strstr(report, "<sizes type=\"waste\" count=\"") != NULL);
+#endif
+    assert_that("The report should have the free sizes.",
+                strstr(strstr(report, "<sizes type=\"free\""), "<size from=\"1024\" to=\"2047\" count=\"") != NULL);
+    assert_that("The report should have the longest runs of free space.",
+                strstr(report, "<longest-free>\n<block ") != NULL);
+    assert_that("The report should end.", strstr(report, "</slabs>\n</malloc>\n") != NULL);
+    fclose(reportFile);
+    reportFile = tmpfile();
+    assert_eq(0, malloc_info(MALLOC_INFO_SUMMARY, reportFile));
+    report[pread(fileno(reportFile), report, sizeof(report) - 1, 0)] = '\0';
+    assert_that("A summary should leave the layout out.", strstr(report, "<block ") > strstr(report, "</heap>"));
+    assert_eq(-1, malloc_info(2, reportFile));
+    fclose(reportFile);
+    free(reported);
+    free(reportedAfter);
+
+    // Tests that slab objects freed by another thread than the one that owns their slab are pushed onto the slab's list
+    // of remote frees, and reclaimed by the owner when it next runs out of space.
+    mallopt(M_SLAB_MAX_SIZE, 256);
+    static struct remote_free_worker remoteFreeWorker;
+    pthread_barrier_init(&remoteFreeWorker.barrier, NULL, 2);
+    malloc_get_counters(&counters);
+    size_t ownObjects = counters.size_class_objects[1];
+    pthread_t remoteFreeThread;
+    pthread_create(&remoteFreeThread, NULL, allocate_for_remote_free, &remoteFreeWorker);
+    pthread_barrier_wait(&remoteFreeWorker.barrier);
+    for (int i = 0; i < REMOTE_FREE_OBJECTS; i++) {
+        free(remoteFreeWorker.objects[0][i]);
+    }
+    malloc_get_counters(&counters);
+    // Only the worker's full slabs were given up, so the frees into the slab it still owns wait for it.
+    assert_that("Remote frees should wait for their owner.", counters.size_class_objects[1] > ownObjects);
+    assert_that("Frees into slabs without an owner should be immediate.",
+                counters.size_class_objects[1] < ownObjects + REMOTE_FREE_OBJECTS);
+    pthread_barrier_wait(&remoteFreeWorker.barrier);
+    pthread_barrier_wait(&remoteFreeWorker.barrier);
+    malloc_get_counters(&counters);
+    assert_eq(ownObjects + REMOTE_FREE_OBJECTS, counters.size_class_objects[1]);
+    pthread_barrier_wait(&remoteFreeWorker.barrier);
+    pthread_join(remoteFreeThread, NULL);
+    // The worker gave up its slabs when it exited.
+    for (int i = 0; i < REMOTE_FREE_OBJECTS; i++) {
+        free(remoteFreeWorker.objects[1][i]);
+    }
+    malloc_get_counters(&counters);
+    assert_eq(ownObjects, counters.size_class_objects[1]);
+    pthread_barrier_destroy(&remoteFreeWorker.barrier);
+    mallopt(M_SLAB_MAX_SIZE, 0);
+
+    // Tests that big free blocks that stay dirty for the decay time have their pages purged, by the calls that free
+    // memory or by the decay thread, and are then known to be zero so that calloc leaves their pages untouched.
+    mallopt(M_DECAY_TIME, 1);
+    char* ticker = malloc(1000);
+    char* tickerGuard = malloc(1000);
+    char* decaying = malloc(64 * 1024);
+    char* decayGuard = malloc(1000);
+    memset(decaying, 0xAB, 64 * 1024);
+    malloc_get_counters(&counters);
+    size_t purged = counters.decay_purged;
+    free(decaying);
+    // Frees only check the clock every so many calls, so keep freeing until the block decays, for up to 10 seconds.
+    for (int i = 0; i < 10000 && counters.decay_purged - purged < 60 * 1024; i++) {
+        usleep(1000);
+        for (int j = 0; j < 100; j++) {
+            free(ticker);
+            ticker = malloc(1000);
+        }
+        malloc_get_counters(&counters);
+    }
+    assert_that("Frees should purge decayed blocks.", counters.decay_purged - purged >= 60 * 1024);
+    char* decayedPages = (char*) (((uintptr_t) decaying + 8192) & ~(uintptr_t) 4095);
+    unsigned char resident[8];
+    mincore(decayedPages, sizeof(resident) * 4096, resident);
+    assert_that("Purged pages should be given back.", !memchr(resident, 1, sizeof(resident)));
+    char* recycled = calloc(1, 64 * 1024);
+    assert_ptr_eq(decaying, recycled);
+    mincore(decayedPages, sizeof(resident) * 4096, resident);
+    assert_that("calloc should trust purged pages to be zero.", !memchr(resident, 1, sizeof(resident)));
+    int nonZero = 0;
+    for (int i = 0; i < 64 * 1024; i++) {
+        nonZero |= recycled[i];
+    }
+    assert_eq(0, nonZero);
+    memset(recycled, 0xCD, 64 * 1024);
+    assert_eq(1, mallopt(M_DECAY_THREAD, 1));
+    purged = counters.decay_purged;
+    free(recycled);
+    for (int i = 0; i < 10000 && counters.decay_purged - purged < 60 * 1024; i++) {
+        usleep(1000);
+        malloc_get_counters(&counters);
+    }
+    assert_that("The decay thread should purge decayed blocks.", counters.decay_purged - purged >= 60 * 1024);
+    assert_eq(1, mallopt(M_DECAY_THREAD, 0));
+    assert_eq(0, mallopt(M_DECAY_THREAD, 2));
+    mallopt(M_DECAY_TIME, 10000);
+    free(ticker);
+    free(tickerGuard);
+    free(decayGuard);
 }
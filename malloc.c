@@ -2,269 +2,3069 @@
  * malloc.c
  *
  * Malloc library: malloc/calloc/realloc/free implementation.
+ * Safe to call from multiple threads at once.
  * Does not include these standard (ANSI/SVID/...) functions:
- *   memalign(size_t alignment, size_t n);
- *   valloc(size_t n);
  *   mallinfo();
- *   mallopt(int parameter_number, int parameter_value);
  *
  * Written by Darren Chan <darrennchan8@gmail.com>
  */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include "malloc.h"
+#include "profile.h"
+#include "trace.h"
 
-#define META_SIZE sizeof(struct allocation_block)
-#define align(size) ((size) + (8 - ((int) (size) + META_SIZE) % 8) % 8)
+// Compile-time policies, set with -D (see CMakeLists.txt), so that a disabled feature costs nothing:
+//   MALLOC_ALIGNMENT: The alignment of every allocation's data (see malloc.h). A cache line keeps allocations from
+//     sharing one, at the cost of more space wasted on small allocations.
+//   MALLOC_FIRST_FIT: Defined to take the first big enough free block in a bin instead of the best fitting one among
+//     the first BIN_SCAN_LIMIT, trading some fragmentation for shorter searches.
+//   MALLOC_HARDENED: 1 (the default) to validate every pointer passed to `free` and `realloc` against the heap, so that
+//     invalid pointers and double frees are ignored, or 0 to trust the caller.
+// __DEBUG__ builds are instrumented: they record each block's requested size and check sized frees.
+#if MALLOC_ALIGNMENT < 16 || MALLOC_ALIGNMENT > 64 || MALLOC_ALIGNMENT & (MALLOC_ALIGNMENT - 1)
+#error "MALLOC_ALIGNMENT must be 16, 32 or 64."
+#endif
+#ifndef MALLOC_HARDENED
+#define MALLOC_HARDENED 1
+#endif
+
+#define META_SIZE ALLOCATION_META_SIZE
+// Every allocation's data starts at a multiple of ALIGNMENT bytes.
+#define ALIGNMENT MALLOC_ALIGNMENT
+// A free block's data starts with its bin or tree links. Small free blocks only use their two bin links, and must
+// also fit their footer.
+#define FREE_LINKS_SIZE (sizeof(struct allocation_block) - META_SIZE)
+#define MIN_DATA_SIZE (2 * sizeof(struct allocation_block*) + sizeof(size_t))
+// Rounds a data size up so that the next block's data is aligned as well.
+#define align(size) \
+    (((((size) < MIN_DATA_SIZE ? MIN_DATA_SIZE : (size)) + META_SIZE + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1)) \
+            - META_SIZE)
+// Mapped blocks start this far into their first page, so that their data is aligned. Blocks mapped for a bigger
+// alignment start META_SIZE bytes before the end of their first page instead, so that their data starts a page in.
+#define MMAP_HEADER_OFFSET ((ALIGNMENT - META_SIZE % ALIGNMENT) % ALIGNMENT)
+#define mapping_offset(block) ((uintptr_t) (block) % getpagesize() == MMAP_HEADER_OFFSET \
+        ? MMAP_HEADER_OFFSET : (size_t) getpagesize() - META_SIZE)
 #define TRUE 1
 #define FALSE 0
 
+// The layout of allocation_block's header: flags in the bottom 3 bits, the data size up to bit TAG_SHIFT, and the tag
+// above it.
+#define FREE 1
+#define PREVIOUS_IN_USE 2
+// Set on a free block whose data is all zero apart from its bin links and footer.
+#define ZEROED 4
+// Set on an allocated block that the heap profiler sampled, whose last word then holds its sample. Only free blocks are
+// ever zeroed, so the two share a bit.
+#define SAMPLED 4
+#define TAG_SHIFT 48
+#define SIZE_MASK ((((size_t) 1) << TAG_SHIFT) - 8)
+#define HEAP_TAG ((size_t) 0xA110)
+#define TCACHE_TAG ((size_t) 0xCACE)
+#define MMAP_TAG ((size_t) 0x3A9B)
+#define ARENA_TAG ((size_t) 0xA4E4)
+#define block_size(block) ((block)->header & SIZE_MASK)
+#define block_tag(block) (__atomic_load_n(&(block)->header, __ATOMIC_RELAXED) >> TAG_SHIFT)
+#define is_free(block) ((block)->header & FREE)
+#define block_data(block) ((void*) ((char*) (block) + META_SIZE))
+#define data_block(ptr) ((struct allocation_block*) ((char*) (ptr) - META_SIZE))
+#define block_footer(block) ((size_t*) ((char*) block_data(block) + block_size(block)) - 1)
+#define next_block(block) ((struct allocation_block*) ((char*) block_data(block) + block_size(block)))
+#define previous_block(block) ((struct allocation_block*) ((char*) (block) - ((size_t*) (block))[-1] - META_SIZE))
+#define block_sample(block) (((struct profile_sample**) next_block(block))[-1])
+
+// The heap grows with sbrk, unless M_HEAP_RESERVE reserves a region for it to grow inside of instead. The region is
+// aligned to HUGE_PAGE_SIZE, and is advised to use transparent huge pages once the heap reaches `hugepage_threshold`.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define SLAB_MAGIC 0x51AB51AB
+// Allocations of at least this many bytes get their own mapping by default, as in glibc.
+#define MMAP_DEFAULT_THRESHOLD (128 * 1024)
+// A free tail bigger than this many bytes is given back to the OS by default, down to `top_pad` bytes.
+#define TRIM_DEFAULT_THRESHOLD (128 * 1024)
+// The heap grows by at least this many bytes at a time by default, and the step doubles with each growth up to
+// HEAP_GROWTH_MAX. Allocations are carved out of the free tail that growing leaves behind.
+#define HEAP_GROWTH_DEFAULT (64 * 1024)
+#define HEAP_GROWTH_MAX (4 * 1024 * 1024)
+// Free blocks in free_tree that stay dirty for `decay_time` milliseconds have their whole pages purged. Dirty blocks
+// wait in DECAY_EPOCHS lists, one per step of DECAY_STEPS that the decay time is split into, by the step they were
+// freed in. The clock is read on one in every DECAY_TICKS calls that free heap memory, or by the decay thread, and
+// each check purges at most DECAY_PURGE_LIMIT of the blocks that have waited a whole decay time.
+#define DECAY_DEFAULT_TIME 10000
+#define DECAY_STEPS 10
+#define DECAY_EPOCHS (DECAY_STEPS + 1)
+#define DECAY_TICKS 64
+#define DECAY_PURGE_LIMIT 16
+
+// Free blocks are kept in segregated bins: one exact bin per 8-byte size below SMALL_BIN_LIMIT, followed by
+// LARGE_BINS_PER_POWER log-spaced bins for every power of two above it, up to TREE_MIN_SIZE. Free blocks of at least
+// TREE_MIN_SIZE bytes are kept in free_tree instead, so that they are always found by true best fit.
+#define BIN_COUNT 128
+#define SMALL_BIN_COUNT 64
+#define SMALL_BIN_LIMIT (SMALL_BIN_COUNT * 8)
+#define LOG2_SMALL_BIN_LIMIT 9
+#define LARGE_BINS_PER_POWER 4
+// Blocks in a large bin don't all have the same size, so this many of them are compared to find a good fit.
+#define BIN_SCAN_LIMIT 16
+#define TREE_MIN_SIZE 4096
+// free_tree is a treap ordered by (size, address). Each block's priority is a hash of its address, which keeps the tree
+// balanced on average without storing anything more.
+#define tree_priority(block) ((uintptr_t) (block) * 0x9E3779B97F4A7C15ULL)
+#define tree_less(a, b) (block_size(a) < block_size(b) || (block_size(a) == block_size(b) && (a) < (b)))
+
+// Blocks with data sizes up to TCACHE_MAX_SIZE are cached per thread, up to `tcache_count` blocks of each size, and
+// move between a thread's cache and the heap TCACHE_BATCH blocks at a time.
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_BIN_COUNT (TCACHE_MAX_SIZE / 8 + 1)
+#define TCACHE_BATCH 8
+#define TCACHE_DEFAULT_COUNT 16
+
+// Objects of up to SLAB_MAX_SIZE bytes are packed without headers into SLAB_SIZE-aligned slabs, one per multiple of
+// ALIGNMENT bytes. Slabs are carved out of a single reserved region of SLAB_REGION_SIZE bytes. Each thread owns a slab
+// per class that it allocates from without a lock, and other threads free into it through a lock-free list, so
+// objects passed between threads don't contend on the class's lock.
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASS_COUNT (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_SIZE 4096
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / ALIGNMENT / 64)
+#define SLAB_REGION_SIZE (1UL << 32)
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1))
+#define slab_objects(slab) ((char*) (slab) + SLAB_HEADER_SIZE)
+#define slab_class_for(object_size) (&slab_classes[(object_size) / ALIGNMENT - 1])
+#define SLAB_ABANDONED ((void*) 1)
+_Static_assert(SLAB_CLASS_COUNT == MALLOC_SIZE_CLASS_COUNT, "malloc_counters needs a count for every slab class");
+
+struct slab {
+    // Links within the class's list of slabs with free slots.
+    struct slab* next;
+    struct slab* previous;
+    unsigned int magic;
+    unsigned int object_size;
+    unsigned int capacity;
+    unsigned int used;
+    // The thread that allocates from the slab and changes its bitmap without a lock, or NULL if the class's lock guards
+    // it instead.
+    struct thread_cache* owner;
+    // Objects freed by threads other than the owner, linked through their first 8 bytes, for the owner to reclaim. Set
+    // to SLAB_ABANDONED while the slab has no owner.
+    void* remote_free;
+    // Bit i is set if and only if slot i is free.
+    unsigned long free_bitmap[SLAB_BITMAP_WORDS];
+};
+
+struct slab_class {
+    pthread_mutex_t lock;
+    // The slabs with free slots that no thread owns.
+    struct slab* partial;
+    // The number of slabs owned by this class and of objects handed out from them, including cached objects and remote
+    // frees that haven't been reclaimed. Owners allocate without the lock, so `objects` is changed atomically.
+    size_t slabs;
+    size_t objects;
+};
+
+// Arena objects are bumped out of chunks, each a heap block tagged ARENA_TAG. Every object has a header tagged
+// ARENA_TAG as well, so that `free` ignores it.
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_CHUNK_HEADER_SIZE ((sizeof(struct arena_chunk) + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1))
+// How far into a chunk the first object's header goes, so that the object's data is aligned.
+#define ARENA_OBJECTS_OFFSET (ARENA_CHUNK_HEADER_SIZE + (ALIGNMENT - META_SIZE % ALIGNMENT) % ALIGNMENT)
+
+struct arena_chunk {
+    // The arena's chunks, newest first.
+    struct arena_chunk* next;
+};
+
+struct arena {
+    struct arena_chunk* chunks;
+    // Where the next object's header goes in the newest chunk, and the end of that chunk's data.
+    char* next;
+    char* end;
+};
+
+// `malloc_info` buckets sizes by powers of two, and lists the INFO_LONGEST_COUNT biggest free blocks.
+#define INFO_BUCKET_COUNT 65
+#define INFO_LONGEST_COUNT 8
+#define info_bucket(size) ((size) ? 64 - __builtin_clzl(size) : 0)
+
+// A heap block seen by `malloc_info`, kept to be written out once the heap lock is released.
+struct info_block {
+    void* ptr;
+    size_t size;
+    size_t requested_size;
+    int free;
+};
+
+struct info_report {
+    // The report is written straight to this file through the buffer, since stdio may allocate.
+    int fd;
+    int failed;
+    int options;
+    char buffer[4096];
+    size_t used;
+    // The blocks seen while walking the heap, in a scratch mapping of room for `block_capacity` of them.
+    struct info_block* blocks;
+    size_t block_count;
+    size_t block_capacity;
+    // Per power of two bucket (see info_bucket), the number of free and in use blocks and their data sizes.
+    size_t free_counts[INFO_BUCKET_COUNT];
+    size_t free_sizes[INFO_BUCKET_COUNT];
+    size_t used_counts[INFO_BUCKET_COUNT];
+    size_t used_sizes[INFO_BUCKET_COUNT];
+    // Per power of two bucket, the number of blocks that waste that much past the size that was asked for.
+    size_t waste_counts[INFO_BUCKET_COUNT];
+    size_t requested_size;
+    // The biggest free blocks, biggest first.
+    void* longest[INFO_LONGEST_COUNT];
+    size_t longest_sizes[INFO_LONGEST_COUNT];
+};
+
+struct thread_cache {
+    // Cached slab objects or heap blocks of size 8 * i, linked through their first 8 bytes.
+    void* bins[TCACHE_BIN_COUNT];
+    int counts[TCACHE_BIN_COUNT];
+    int registered;
+    int shutting_down;
+    // The slab of each class that this thread owns.
+    struct slab* slabs[SLAB_CLASS_COUNT];
+};
+
+// Guards every allocation block and bin below; only the calling thread's cache may be used without it.
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+// The initial-exec model makes the cache a fixed offset from the thread pointer, so using it never calls into the
+// dynamic loader, which may allocate, even when this is loaded as a shared library.
+__thread struct thread_cache thread_cache __attribute__((tls_model("initial-exec")));
+pthread_key_t thread_cache_key;
+pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+int tcache_count = TCACHE_DEFAULT_COUNT;
+size_t slab_max_size = SLAB_MAX_SIZE;
+size_t mmap_threshold = MMAP_DEFAULT_THRESHOLD;
+size_t trim_threshold = TRIM_DEFAULT_THRESHOLD;
+size_t top_pad = 0;
+size_t heap_growth_min = HEAP_GROWTH_DEFAULT;
+// The step the heap grows by next, or 0 to grow by exactly what is needed.
+size_t heap_growth = HEAP_GROWTH_DEFAULT;
+size_t decay_time = DECAY_DEFAULT_TIME;
+// When the decay time's next step starts, in milliseconds, and the calls left until the clock is read again.
+size_t decay_next = 0;
+size_t decay_ticks = 0;
+// The dirty free blocks in free_tree, linked through their unused bin links into circular lists headed by these
+// sentinels, one per step of the decay time that they were freed in. The list after `decay_epoch`'s is the oldest.
+struct allocation_block decay_lists[DECAY_EPOCHS];
+size_t decay_epoch = 0;
+// Whether the oldest list still holds blocks that the last check had no time left to purge.
+int decay_backlog = FALSE;
+// Whether the decay thread should be running, and whether it is. Both are only changed atomically.
+int decay_thread_wanted = FALSE;
+int decay_thread_running = FALSE;
+
+struct slab_class slab_classes[SLAB_CLASS_COUNT] = {[0 ... SLAB_CLASS_COUNT - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0}};
+// Guards the slab region's bump pointer and its list of empty slabs.
+pthread_mutex_t slab_region_lock = PTHREAD_MUTEX_INITIALIZER;
+char* slab_region = NULL;
+size_t slab_region_used = 0;
+struct slab* free_slabs = NULL;
+
 struct allocation_block* allocation_head = NULL;
 struct allocation_block* allocation_tail = NULL;
+// Memory from here up that morecore hands out is known to be zero; below it, the break was lowered into a page that
+// stays mapped with whatever it held. NULL until the heap is first trimmed.
+char* heap_clean_from = NULL;
+int heap_started = FALSE;
+size_t heap_reserve_size = 0;
+size_t hugepage_threshold = 0;
+char* heap_region = NULL;
+char* heap_region_break = NULL;
+char* heap_region_end = NULL;
+// The region is reserved without access, and the part of it below here is committed for the heap to use.
+char* heap_region_committed = NULL;
+int heap_region_huge = FALSE;
+
+struct allocation_block* free_bins[BIN_COUNT];
+// Bit i is set if and only if free_bins[i] is non-empty.
+unsigned long free_bins_bitmap[BIN_COUNT / 64];
+struct allocation_block* free_tree = NULL;
+
+// Running totals for `mallinfo2` and `malloc_get_counters`. The heap's are guarded by heap_lock, and the mappings' are
+// updated atomically since mapped blocks are handled without a lock.
+size_t heap_size = 0;
+size_t heap_free_size = 0;
+size_t heap_free_blocks = 0;
+size_t heap_max_size = 0;
+size_t sbrk_calls = 0;
+size_t mapped_blocks = 0;
+size_t mapped_size = 0;
+size_t decay_purged = 0;
+
+/**
+ * Reads the coarse monotonic clock.
+ *
+ * @return The current time in milliseconds.
+ */
+size_t decay_clock() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+    return (size_t) time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+/**
+ * Finds the index of the bin that a free block of size `size` belongs to.
+ *
+ * @param size The data size of the block.
+ * @return The bin index, between 0 and BIN_COUNT - 1.
+ */
+size_t bin_index(size_t size) {
+    if (size < SMALL_BIN_LIMIT) {
+        return size / 8;
+    }
+    int log = 63 - __builtin_clzl(size);
+    size_t index = SMALL_BIN_COUNT + (log - LOG2_SMALL_BIN_LIMIT) * LARGE_BINS_PER_POWER
+            + ((size >> (log - 2)) & (LARGE_BINS_PER_POWER - 1));
+    return index < BIN_COUNT ? index : BIN_COUNT - 1;
+}
+
+/**
+ * Inserts a free block into a subtree of free_tree, rotating it up above any nodes of lower priority.
+ *
+ * @param root The link to the root of the subtree.
+ * @param block The free block to insert.
+ */
+void tree_insert(struct allocation_block** root, struct allocation_block* block) {
+    struct allocation_block* node = *root;
+    if (!node) {
+        block->children[0] = block->children[1] = NULL;
+        *root = block;
+        return;
+    }
+    int side = tree_less(node, block);
+    tree_insert(&node->children[side], block);
+    struct allocation_block* child = node->children[side];
+    if (tree_priority(child) > tree_priority(node)) {
+        node->children[side] = child->children[!side];
+        child->children[!side] = node;
+        *root = child;
+    }
+}
 
 /**
- * Finds the best-fitting (smallest possible) free block of size at least `size`, or NULL if it doesn't exist.
+ * Removes a free block from free_tree, rotating it down until it has at most one child to take its place.
+ *
+ * @param block The free block to remove, which must be in free_tree.
+ */
+void tree_remove(struct allocation_block* block) {
+    struct allocation_block** root = &free_tree;
+    while (*root != block) {
+        root = &(*root)->children[tree_less(*root, block)];
+    }
+    while (block->children[0] && block->children[1]) {
+        int side = tree_priority(block->children[1]) > tree_priority(block->children[0]);
+        struct allocation_block* child = block->children[side];
+        block->children[side] = child->children[!side];
+        child->children[!side] = block;
+        *root = child;
+        root = &child->children[!side];
+    }
+    *root = block->children[0] ? block->children[0] : block->children[1];
+}
+
+/**
+ * Finds the smallest free block in free_tree of size at least `size`, taking the lowest address among equal sizes.
  *
  * @param size The size needed for the allocation block.
- * @return The best-fitting allocation block, or NULL if there aren't any of enough size.
+ * @return The best-fitting block, or NULL if free_tree has none big enough.
  */
-struct allocation_block* find_free_block_best_fit(size_t size) {
+struct allocation_block* tree_best_fit(size_t size) {
     struct allocation_block* best_fit = NULL;
-    for (struct allocation_block *last = allocation_head; last; last = last->next) {
-        if (last->free && last->size >= size) {
-            best_fit = best_fit && best_fit->size <= last->size ? best_fit : last;
+    struct allocation_block* node = free_tree;
+    while (node) {
+        if (block_size(node) >= size) {
+            best_fit = node;
+            node = node->children[0];
+        } else {
+            node = node->children[1];
         }
     }
     return best_fit;
 }
 
 /**
- * Finds the allocation_block associated with a particular memory allocation, or NULL if none match.
+ * Appends a free block that was just put into free_tree to the list of the current step of the decay time, unless it's
+ * already zero or nothing is purged. Blocks that aren't in a list have no next link. Requires heap_lock.
  *
- * @param ptr The memory allocation pointer to the data (e.g: returned by a function like `malloc`).
- * @return The allocation_block associated with ptr, or NULL if none match.
+ * @param block The free block.
  */
-struct allocation_block* find_allocation_block_for_allocation(void* ptr) {
-    for (struct allocation_block* block = allocation_head; block; block = block->next) {
-        if (block + 1 == ptr) {
-            return block;
-        }
-        // Since the heap grows upwards, we can stop checking if we start seeing allocation blocks that are greater than
-        // our target ptr.
-        if ((void*) block > ptr) {
-            break;
-        }
+void decay_list_push(struct allocation_block* block) {
+    struct allocation_block* list = &decay_lists[decay_epoch];
+    if (!decay_time || block->header & ZEROED) {
+        block->next_free = NULL;
+        return;
     }
-    return NULL;
+    block->next_free = list;
+    block->previous_free = list->previous_free;
+    list->previous_free->next_free = block;
+    list->previous_free = block;
 }
 
 /**
- * Links a new block after allocation_tail with size `size` or extends allocation_tail if free.
+ * Takes a free block out of its decay list, if it is in one. Requires heap_lock.
  *
- * @param size The size needed for the allocation block.
- * @return The allocation block, or NULL if sbrk failed.
+ * @param block The free block in free_tree.
  */
-struct allocation_block* request_space(size_t size) {
-    // Extend and reuse the tail if possible.
-    if (allocation_tail && allocation_tail->free) {
-        if (sbrk((int) (size - allocation_tail->size)) == (void*) -1) {
-            return NULL;
-        }
-        allocation_tail->free = FALSE;
-        allocation_tail->size = size;
-        return allocation_tail;
+void decay_list_remove(struct allocation_block* block) {
+    if (block->next_free) {
+        block->next_free->previous_free = block->previous_free;
+        block->previous_free->next_free = block->next_free;
+        block->next_free = NULL;
     }
-    struct allocation_block *block = sbrk(META_SIZE + size);
-    if (block == (void*) -1) {
-        return NULL;
+}
+
+/**
+ * Pushes a free block onto the front of the bin for its size, or into free_tree if it's big.
+ *
+ * @param block The free block to bin.
+ */
+void bin_insert(struct allocation_block* block) {
+    heap_free_size += block_size(block);
+    heap_free_blocks++;
+    if (block_size(block) >= TREE_MIN_SIZE) {
+        tree_insert(&free_tree, block);
+        decay_list_push(block);
+        return;
+    }
+    size_t index = bin_index(block_size(block));
+    block->previous_free = NULL;
+    block->next_free = free_bins[index];
+    if (block->next_free) {
+        block->next_free->previous_free = block;
     }
+    free_bins[index] = block;
+    free_bins_bitmap[index / 64] |= 1UL << (index % 64);
+}
 
-    // Initialize the new tail.
-    block->free = FALSE;
-    block->next = NULL;
-    block->size = size;
-    if (allocation_tail) {
-        allocation_tail->next = block;
+/**
+ * Unlinks a free block from its bin or free_tree. Must be called before the block's size changes.
+ *
+ * @param block The binned block to remove.
+ */
+void bin_remove(struct allocation_block* block) {
+    heap_free_size -= block_size(block);
+    heap_free_blocks--;
+    if (block_size(block) >= TREE_MIN_SIZE) {
+        tree_remove(block);
+        decay_list_remove(block);
+        return;
+    }
+    if (block->previous_free) {
+        block->previous_free->next_free = block->next_free;
     } else {
-        allocation_head = block;
+        size_t index = bin_index(block_size(block));
+        free_bins[index] = block->next_free;
+        if (!block->next_free) {
+            free_bins_bitmap[index / 64] &= ~(1UL << (index % 64));
+        }
+    }
+    if (block->next_free) {
+        block->next_free->previous_free = block->previous_free;
     }
-    block->previous = allocation_tail;
-    return allocation_tail = block;
 }
 
 /**
- * Partitions an allocation_block and splits into left and right allocation_blocks, if the new right portion can hold at
- * least 8 bytes in addition to the size of the meta information.
+ * Finds the first non-empty bin with index at least `index`.
  *
- * @param left The allocation_block to split.
- * @param size The required data size for the left block.
- * @return The right allocation_block, or NULL if we aren't able to split.
+ * @param index The smallest bin index to consider.
+ * @return The index of the non-empty bin, or BIN_COUNT if there aren't any.
  */
-struct allocation_block* split_if_possible(struct allocation_block* left, size_t size) {
-    size_t right_size = left->size - size;
-    if (right_size >= 8 + META_SIZE) {
-        left->size = size;
-        struct allocation_block* right = (void*) (left + 1) + left->size;
-        right->size = right_size - META_SIZE;
-        right->free = TRUE;
-        right->previous = left;
-        right->next = left->next;
-        left->next = right;
-        if (right->next) {
-            right->next->previous = right;
+size_t next_nonempty_bin(size_t index) {
+    for (size_t word = index / 64; word < BIN_COUNT / 64; word++) {
+        unsigned long bits = free_bins_bitmap[word];
+        if (word == index / 64) {
+            bits &= ~0UL << (index % 64);
         }
-        if (left == allocation_tail) {
-            allocation_tail = right;
+        if (bits) {
+            return word * 64 + __builtin_ctzl(bits);
         }
-        return right;
     }
-    return NULL;
+    return BIN_COUNT;
 }
 
 /**
- * Merges the current block with surrounding blocks if available and returns a pointer to the merged block. If the
- * current block is not free, the merged block is guaranteed to have the same data as the original block after merging.
+ * Finds the best-fitting (smallest) block of size at least `size` among the first BIN_SCAN_LIMIT blocks of a bin.
  *
- * @param block The block to merge with adjacent blocks.
- * @return A pointer to the merged block.
+ * @param index The bin to search.
+ * @param size The size needed for the allocation block.
+ * @return The best-fitting block found, or NULL if none of the scanned blocks are big enough.
  */
-struct allocation_block* merge_adjacent_free(struct allocation_block* block) {
-    struct allocation_block* previous_block = block->previous;
-    struct allocation_block* next_block = block->next;
-    if (previous_block && previous_block->free) {
-        if (block == allocation_tail) {
-            allocation_tail = previous_block;
+struct allocation_block* best_fit_in_bin(size_t index, size_t size) {
+    struct allocation_block* best_fit = NULL;
+    int scanned = 0;
+    for (struct allocation_block* block = free_bins[index]; block && scanned < BIN_SCAN_LIMIT; block = block->next_free) {
+        if (block_size(block) >= size && (!best_fit || block_size(block) < block_size(best_fit))) {
+            best_fit = block;
+#ifdef MALLOC_FIRST_FIT
+            break;
+#else
+            if (block_size(block) == size) {
+                break;
+            }
+#endif
         }
-        previous_block->next = block->next;
-        if (next_block) {
-            next_block->previous = previous_block;
+        scanned++;
+    }
+    return best_fit;
+}
+
+/**
+ * Finds the best-fitting (smallest possible) free block of size at least `size`, or NULL if it doesn't exist. Small
+ * sizes have exact bins and big sizes are looked up in free_tree, so the fit is exact; for sizes in between the fit is
+ * the best among a bounded number of candidates from the closest bins.
+ *
+ * @param size The size needed for the allocation block.
+ * @return The best-fitting allocation block, or NULL if there aren't any of enough size.
+ */
+struct allocation_block* find_free_block_best_fit(size_t size) {
+    if (size < TREE_MIN_SIZE) {
+        size_t index = bin_index(size);
+        struct allocation_block* best_fit = best_fit_in_bin(index, size);
+        if (best_fit) {
+            return best_fit;
         }
-        previous_block->size += META_SIZE + block->size;
-        if (!block->free) {
-            memcpy(previous_block + 1, block + 1, block->size);
+        // Every block in a higher bin is big enough, so the closest non-empty one holds the best fit.
+        index = next_nonempty_bin(index + 1);
+        if (index < BIN_COUNT) {
+            return best_fit_in_bin(index, size);
+        }
+    }
+    return tree_best_fit(size);
+}
+
+/**
+ * Finds the size of the largest free block, from the right of free_tree or by scanning the highest non-empty bin.
+ * Requires heap_lock.
+ *
+ * @return The data size of the largest free block, or 0 if there aren't any.
+ */
+size_t largest_free_block_size() {
+    if (free_tree) {
+        struct allocation_block* node = free_tree;
+        while (node->children[1]) {
+            node = node->children[1];
         }
-        block = previous_block;
+        return block_size(node);
     }
-    if (next_block && next_block->free) {
-        if (next_block == allocation_tail) {
-            allocation_tail = block;
+    size_t largest = 0;
+    for (int word = BIN_COUNT / 64 - 1; word >= 0 && !largest; word--) {
+        if (free_bins_bitmap[word]) {
+            size_t index = word * 64 + 63 - __builtin_clzl(free_bins_bitmap[word]);
+            for (struct allocation_block* block = free_bins[index]; block; block = block->next_free) {
+                largest = block_size(block) > largest ? block_size(block) : largest;
+            }
         }
-        block->next = next_block->next;
-        if (next_block->next) {
-            next_block->next->previous = block;
+    }
+    return largest;
+}
+
+/**
+ * Reserves the heap region when the heap is first grown, if M_HEAP_RESERVE or else the MALLOC_HEAP_RESERVE environment
+ * variable (both in MiB) asks for one. The environment's region also takes its `hugepage_threshold` from
+ * MALLOC_HUGEPAGE_THRESHOLD. The heap falls back to sbrk if the region can't be mapped. The decay lists are set up here
+ * too, before any block can be freed into them. Requires heap_lock.
+ */
+void start_heap() {
+    heap_started = TRUE;
+    for (size_t i = 0; i < DECAY_EPOCHS; i++) {
+        decay_lists[i].next_free = decay_lists[i].previous_free = &decay_lists[i];
+    }
+    char* reserve = getenv("MALLOC_HEAP_RESERVE");
+    char* threshold = getenv("MALLOC_HUGEPAGE_THRESHOLD");
+    if (!heap_reserve_size && reserve) {
+        heap_reserve_size = strtoul(reserve, NULL, 10) * 1024 * 1024;
+        if (threshold) {
+            hugepage_threshold = strtoul(threshold, NULL, 10);
         }
-        block->size += META_SIZE + next_block->size;
     }
-    return block;
+    if (!heap_reserve_size) {
+        return;
+    }
+    // Map a huge page more than needed, and unmap the ends so that the region starts on a huge page.
+    size_t length = (heap_reserve_size + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+    char* mapping = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return;
+    }
+    heap_region = (char*) (((uintptr_t) mapping + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    if (heap_region > mapping) {
+        munmap(mapping, heap_region - mapping);
+    }
+    munmap(heap_region + length, mapping + HUGE_PAGE_SIZE - heap_region);
+    heap_region_break = heap_region;
+    heap_region_committed = heap_region;
+    heap_region_end = heap_region + length;
 }
 
 /**
- * merge_free_right is the same as `merge_adjacent_free` but it only merges with the right block when avaliable. Since
- * the pointer to the merged block will be the same with and without merging, nothing is returned.
+ * Moves the end of the heap by `change` bytes, like sbrk, but inside the heap region if there is one. The region is
+ * committed HUGE_PAGE_SIZE bytes at a time as the heap reaches it, and decommitted as it shrinks. When the heap
+ * shrinks, heap_clean_from is moved to where the memory given back starts. Requires heap_lock.
  *
- * @param block The block to merge with the right block.
+ * @param change The number of bytes to move the end of the heap by.
+ * @return The old end of the heap, or (void*) -1 if it can't move.
  */
-void merge_free_right(struct allocation_block* block) {
-    // Pretend like the left block isn't free when necessary.
-    if (block->previous && block->previous->free) {
-        block->previous->free = FALSE;
-        merge_adjacent_free(block);
-        block->previous->free = TRUE;
+void* morecore(intptr_t change) {
+    if (!heap_started) {
+        start_heap();
+    }
+    char* old_break;
+    size_t granularity = getpagesize();
+    if (!heap_region) {
+        old_break = sbrk(change);
+        if (old_break == (void*) -1) {
+            return old_break;
+        }
     } else {
-        merge_adjacent_free(block);
+        old_break = heap_region_break;
+        if (change > heap_region_end - old_break || change < heap_region - old_break) {
+            errno = ENOMEM;
+            return (void*) -1;
+        }
+        heap_region_break += change;
+        if (heap_region_break > heap_region_committed) {
+            char* committed = (char*) (((uintptr_t) heap_region_break + HUGE_PAGE_SIZE - 1)
+                    & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+            if (mprotect(heap_region_committed, committed - heap_region_committed, PROT_READ | PROT_WRITE)) {
+                heap_region_break = old_break;
+                errno = ENOMEM;
+                return (void*) -1;
+            }
+            heap_region_committed = committed;
+        }
+        if (!heap_region_huge && (size_t) (heap_region_break - heap_region) >= hugepage_threshold) {
+            // Advising the whole region makes the kernel back it with huge pages as it is touched.
+            heap_region_huge = madvise(heap_region, heap_region_end - heap_region, MADV_HUGEPAGE) == 0;
+        }
+        if (heap_region_huge) {
+            granularity = HUGE_PAGE_SIZE;
+        }
     }
+    if (change < 0) {
+        // Only whole pages above the new end are given back; the rest of its page keeps the old data.
+        char* new_break = old_break + change;
+        char* released = (char*) (((uintptr_t) new_break + granularity - 1) & ~(uintptr_t) (granularity - 1));
+        if (heap_region) {
+            // Memory above the old end may not have been given back yet either.
+            char* dirty_end = heap_clean_from > old_break ? heap_clean_from : old_break;
+            if (dirty_end > released) {
+                madvise(released, dirty_end - released, MADV_DONTNEED);
+            }
+            char* committed = (char*) (((uintptr_t) released + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+            if (committed < heap_region_committed
+                    && mprotect(committed, heap_region_committed - committed, PROT_NONE) == 0) {
+                heap_region_committed = committed;
+            }
+        }
+        heap_clean_from = released;
+    }
+    return old_break;
 }
 
-void* malloc(size_t size) {
-    if (size <= 0) {
+/**
+ * Records that the heap grew or shrank by `change` bytes through one call to morecore. Requires heap_lock.
+ *
+ * @param change The number of bytes the program break moved by.
+ */
+void record_sbrk(intptr_t change) {
+    heap_size += change;
+    heap_max_size = heap_size > heap_max_size ? heap_size : heap_max_size;
+    sbrk_calls++;
+}
+
+/**
+ * Finds the allocation_block associated with a particular memory allocation, or NULL if none match. The header sits
+ * right before the data, so it is computed directly and validated by its position (within the heap, or at one of the
+ * two offsets into a page that mapped blocks start at) and its tag.
+ *
+ * @param ptr The memory allocation pointer to the data (e.g: returned by a function like `malloc`).
+ * @return The allocation_block associated with ptr, or NULL if none match.
+ */
+struct allocation_block* find_allocation_block_for_allocation(void* ptr) {
+    struct allocation_block* block = data_block(ptr);
+    if (!ptr || (uintptr_t) ptr % 8) {
         return NULL;
     }
-    size_t aligned_size = align(size);
-    struct allocation_block* allocated_block = find_free_block_best_fit(aligned_size);
-    if (allocated_block) {
-        allocated_block->free = FALSE;
-        split_if_possible(allocated_block, aligned_size);
-    } else {
-        // Allocate a new block.
-        allocated_block = request_space(aligned_size);
+#if !MALLOC_HARDENED
+    // Trust that the pointer was returned by `*alloc`, so only the tag is read to tell heap and mapped blocks apart.
+    // Slab objects have no header to read.
+    char* region = __atomic_load_n(&slab_region, __ATOMIC_ACQUIRE);
+    if ((!region || (char*) ptr < region || (char*) ptr >= region + SLAB_REGION_SIZE)
+            && (block_tag(block) == MMAP_TAG || block_tag(block) == HEAP_TAG)) {
+        return block;
     }
-#ifdef __DEBUG__
-    allocated_block->requested_size = size;
 #endif
-    return allocated_block + 1;
+    if (block < __atomic_load_n(&allocation_head, __ATOMIC_RELAXED)
+            || block > __atomic_load_n(&allocation_tail, __ATOMIC_RELAXED)) {
+        size_t offset = (uintptr_t) block % getpagesize();
+        return (offset == MMAP_HEADER_OFFSET || offset == getpagesize() - META_SIZE) && block_tag(block) == MMAP_TAG
+                ? block : NULL;
+    }
+    return block_tag(block) == HEAP_TAG ? block : NULL;
 }
 
-void* calloc(size_t num_elements, size_t element_size) {
-    size_t size = num_elements * element_size;
-    if (size <= 0) {
+/**
+ * Finds the block right after `block` in the heap, or NULL if `block` is the tail.
+ *
+ * @param block The heap block to start from.
+ * @return The next block, or NULL if there isn't one.
+ */
+struct allocation_block* next_allocation_block(struct allocation_block* block) {
+    return block == allocation_tail ? NULL : next_block(block);
+}
+
+/**
+ * Gets the data size of a block.
+ *
+ * @param block The block to get the size of.
+ * @return The number of bytes available for data in the block.
+ */
+size_t allocation_block_size(struct allocation_block* block) {
+    return block_size(block);
+}
+
+/**
+ * Checks whether a heap block is free.
+ *
+ * @param block The heap block to check.
+ * @return TRUE if the block is free, or FALSE otherwise.
+ */
+int allocation_block_is_free(struct allocation_block* block) {
+    return is_free(block) ? TRUE : FALSE;
+}
+
+/**
+ * Sets a heap block's data size and whether it is free, keeping its tag and previous-in-use flag. Free blocks get their
+ * footer, and the next block's previous-in-use flag is updated to match. Allocated blocks lose their zeroed flag, since
+ * their data is about to change. allocation_tail must already be up to date.
+ *
+ * @param block The heap block to update.
+ * @param size The data size of the block.
+ * @param free Whether the block is free.
+ */
+void set_block(struct allocation_block* block, size_t size, int free) {
+    block->header = (block->header & ~(SIZE_MASK | FREE | (free ? 0 : ZEROED))) | size | (free ? FREE : 0);
+    if (free) {
+        *block_footer(block) = size;
+    }
+    if (block != allocation_tail) {
+        // The next block may be allocated and having its tag changed by its owner without the lock.
+        if (free) {
+            __atomic_fetch_and(&next_block(block)->header, ~(size_t) PREVIOUS_IN_USE, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_or(&next_block(block)->header, (size_t) PREVIOUS_IN_USE, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Gets the length of the mapping needed for a mapped block of data size `size`.
+ *
+ * @param offset The offset of the block into its mapping (see mapping_offset).
+ * @param size The data size of the block.
+ * @return The length of the mapping, a multiple of the page size.
+ */
+size_t mapping_length(size_t offset, size_t size) {
+    size_t page_size = getpagesize();
+    return (offset + META_SIZE + size + page_size - 1) / page_size * page_size;
+}
+
+/**
+ * Maps a new block of data size at least `size` on its own, outside of the heap.
+ *
+ * @param size The data size needed.
+ * @return The mapped block, or NULL if mmap failed.
+ */
+struct allocation_block* map_block(size_t size) {
+    size_t length = mapping_length(MMAP_HEADER_OFFSET, size);
+    char* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
         return NULL;
     }
-    void* ptr = malloc(size);
-    memset(ptr, 0, size);
-    return ptr;
+    struct allocation_block* block = (struct allocation_block*) (mapping + MMAP_HEADER_OFFSET);
+    block->header = MMAP_TAG << TAG_SHIFT | (length - MMAP_HEADER_OFFSET - META_SIZE);
+    __atomic_fetch_add(&mapped_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mapped_size, length, __ATOMIC_RELAXED);
+    return block;
 }
 
-void* realloc(void* ptr, size_t size) {
-    size_t requested_size = size;
-    size = align(size);
-    struct allocation_block* target_block = find_allocation_block_for_allocation(ptr);
-    if (size <= 0 || !target_block) {
-        free(ptr);
-        return malloc(size);
+/**
+ * Maps a new block of data size at least `size` on its own, with its data starting at a multiple of `alignment`. The
+ * data starts a page into the mapping, which is mapped bigger and trimmed to line it up if `alignment` is bigger than
+ * a page.
+ *
+ * @param alignment The alignment needed, a power of two greater than ALIGNMENT.
+ * @param size The data size needed.
+ * @return The mapped block, or NULL if mmap failed.
+ */
+struct allocation_block* map_aligned_block(size_t alignment, size_t size) {
+    size_t page_size = getpagesize();
+    size_t offset = page_size - META_SIZE;
+    size_t length = mapping_length(offset, size);
+    size_t slack = alignment > page_size ? alignment - page_size : 0;
+    char* mapping = mmap(NULL, length + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return NULL;
     }
-    size_t leftAvailable =
-            target_block->previous && target_block->previous->free ? sizeof(struct allocation_block) + target_block->previous->size : 0;
-    size_t rightAvailable =
-            target_block->next && target_block->next->free ? sizeof(struct allocation_block) + target_block->next->size : 0;
+    char* data = (char*) (((uintptr_t) mapping + page_size + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    char* start = data - page_size;
+    if (start > mapping) {
+        munmap(mapping, start - mapping);
+    }
+    if (mapping + slack > start) {
+        munmap(start + length, mapping + slack - start);
+    }
+    struct allocation_block* block = data_block(data);
+    block->header = MMAP_TAG << TAG_SHIFT | (length - offset - META_SIZE);
+    __atomic_fetch_add(&mapped_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mapped_size, length, __ATOMIC_RELAXED);
+    return block;
+}
 
-    // When reallocating a block, here are the priorities that we will partition by.
-    // 1. Reuse (current block + extend right).
-    //    Since merging with right is an O(1) operation, we can preemptively merge with the right block and then
-    //    repartition over just partitioning the current block to avoid 2 consecutive free blocks to the right,
-    //    limiting fragmentation. If there isn't a next block (i.e: the current block is the tail), we can simply extend
-    //    sbrk, to be as efficient as possible.
-    // 2. Reuse all adjacent blocks.
-    //    Since merging with left is an O(size) operation, we should merge with left only when we can't do (1).
-    // 3. Push a new tail onto the allocation blocks.
-    //    Since this has the same time complexity as (2) but (2) limits fragmentation, we should only do this when all
-    //    other options can't be chosen.
-    if (rightAvailable + target_block->size >= size) {
-        merge_free_right(target_block);
-        split_if_possible(target_block, size);
-#ifdef __DEBUG__
-        target_block->requested_size = requested_size;
-#endif
-        return target_block + 1;
-    } else if (target_block == allocation_tail) {
-        target_block->free = TRUE;
-        request_space(size);
-#ifdef __DEBUG__
-        target_block->requested_size = requested_size;
-#endif
-        return target_block + 1;
-    } else if (leftAvailable + rightAvailable + target_block->size >= size) {
-        target_block = merge_adjacent_free(target_block);
-        split_if_possible(target_block, size);
-#ifdef __DEBUG__
-        target_block->requested_size = requested_size;
-#endif
-        return target_block + 1;
-    } else {
-        // size is guaranteed to be less than target_block's size.
-        void* new_ptr = malloc(requested_size);
-        memcpy(new_ptr, target_block + 1, size);
-        target_block->free = TRUE;
-        merge_adjacent_free(target_block);
-        return new_ptr;
+/**
+ * Resizes a mapped block to data size at least `size`, letting the kernel move its pages instead of copying them.
+ *
+ * @param block The mapped block to resize.
+ * @param size The data size needed.
+ * @return The resized block, or NULL if mremap failed.
+ */
+struct allocation_block* remap_block(struct allocation_block* block, size_t size) {
+    size_t offset = mapping_offset(block);
+    size_t length = mapping_length(offset, size);
+    size_t old_length = offset + META_SIZE + block_size(block);
+    char* mapping = mremap((char*) block - offset, old_length, length, MREMAP_MAYMOVE);
+    if (mapping == MAP_FAILED) {
+        return NULL;
     }
+    __atomic_fetch_add(&mapped_size, length - old_length, __ATOMIC_RELAXED);
+    block = (struct allocation_block*) (mapping + offset);
+    block->header = MMAP_TAG << TAG_SHIFT | (length - offset - META_SIZE);
+    return block;
 }
 
-void free(void* ptr) {
-    for (struct allocation_block* block = allocation_head; block; block = block->next) {
-        if (block + 1 == ptr) {
-            block->free = TRUE;
-            merge_adjacent_free(block);
-            return;
-        }
+/**
+ * Unmaps a mapped block, returning its memory to the OS.
+ *
+ * @param block The mapped block to unmap.
+ */
+void unmap_block(struct allocation_block* block) {
+    size_t offset = mapping_offset(block);
+    size_t length = offset + META_SIZE + block_size(block);
+    block->header = 0;
+    munmap((char*) block - offset, length);
+    __atomic_fetch_sub(&mapped_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&mapped_size, length, __ATOMIC_RELAXED);
+}
+
+/**
+ * Moves the program break so that allocation_tail's data size becomes `size`. The tail must not be binned.
+ *
+ * @param size The new data size for allocation_tail.
+ * @return TRUE if the tail was resized, or FALSE if sbrk failed.
+ */
+int extend_tail(size_t size) {
+    intptr_t change = (intptr_t) (size - block_size(allocation_tail));
+    if (morecore(change) == (void*) -1) {
+        return FALSE;
+    }
+    record_sbrk(change);
+    set_block(allocation_tail, size, is_free(allocation_tail));
+    return TRUE;
+}
+
+/**
+ * Finds how much of some memory just taken from sbrk may not be zero, because it lies below heap_clean_from.
+ *
+ * @param start The start of the memory.
+ * @param size The size of the memory.
+ * @return The number of bytes at the start of the memory that may not be zero.
+ */
+size_t sbrk_dirty_size(char* start, size_t size) {
+    if (start >= heap_clean_from) {
+        return 0;
+    }
+    return (size_t) (heap_clean_from - start) < size ? (size_t) (heap_clean_from - start) : size;
+}
+
+/**
+ * Picks the data size to grow the heap by for a block of data size `size`, and doubles the step for next time. Growing
+ * by a step that doubles up to HEAP_GROWTH_MAX makes a growing heap call morecore a logarithmic number of times rather
+ * than once per allocation. Requires heap_lock.
+ *
+ * @param size The data size needed.
+ * @return The data size to grow by, at least `size`, or exactly `size` if the heap grows exactly.
+ */
+size_t growth_size(size_t size) {
+    if (!heap_growth) {
+        return size;
+    }
+    size_t grown_size = size > heap_growth ? size : align(heap_growth);
+    heap_growth = heap_growth < HEAP_GROWTH_MAX / 2 ? 2 * heap_growth : HEAP_GROWTH_MAX;
+    return grown_size;
+}
+
+/**
+ * Appends a new block after allocation_tail with size `size` or extends allocation_tail if free.
+ *
+ * @param size The size needed for the allocation block.
+ * @param dirty_size Set to the number of bytes at the start of the block's data that may not be zero.
+ * @return The allocation block, or NULL if sbrk failed or the heap can't grow contiguously.
+ */
+struct allocation_block* request_exact_space(size_t size, size_t* dirty_size) {
+    // Extend and reuse the tail if possible.
+    if (allocation_tail && is_free(allocation_tail)) {
+        struct allocation_block* tail = allocation_tail;
+        size_t old_size = block_size(tail);
+        bin_remove(tail);
+        if (!extend_tail(size)) {
+            bin_insert(tail);
+            return NULL;
+        }
+        // The tail was still free while it grew, so it has a footer at both its old and its new end.
+        *block_footer(tail) = 0;
+        size_t dirty = old_size;
+        if (tail->header & ZEROED) {
+            *(size_t*) ((char*) block_data(tail) + old_size - sizeof(size_t)) = 0;
+            dirty = FREE_LINKS_SIZE;
+        }
+        size_t fresh_dirty = sbrk_dirty_size((char*) block_data(tail) + old_size, size - old_size);
+        *dirty_size = fresh_dirty ? old_size + fresh_dirty : dirty;
+        set_block(tail, size, FALSE);
+        return tail;
+    }
+    if (!allocation_tail) {
+        // Line up the first block's data; every later block's data stays aligned because of the sizes before it.
+        size_t misalignment = ((uintptr_t) morecore(0) + META_SIZE) % ALIGNMENT;
+        if (misalignment) {
+            if (morecore(ALIGNMENT - misalignment) == (void*) -1) {
+                return NULL;
+            }
+            record_sbrk(ALIGNMENT - misalignment);
+        }
+    }
+    struct allocation_block *block = morecore(META_SIZE + size);
+    if (block == (void*) -1) {
+        return NULL;
+    }
+    // Blocks are found from their neighbours' addresses, so the heap can't have gaps.
+    if (allocation_tail && block != next_block(allocation_tail)) {
+        morecore(-(intptr_t) (META_SIZE + size));
+        return NULL;
+    }
+    record_sbrk(META_SIZE + size);
+
+    // Initialize the new tail.
+    block->header = HEAP_TAG << TAG_SHIFT | PREVIOUS_IN_USE;
+    *dirty_size = sbrk_dirty_size(block_data(block), size);
+    if (!allocation_tail) {
+        allocation_head = block;
+    }
+    allocation_tail = block;
+    set_block(block, size, FALSE);
+    return block;
+}
+
+/**
+ * Lowers the program break so that only `pad` bytes of allocation_tail's data remain, if the tail is free. At least
+ * MIN_DATA_SIZE bytes are always kept, so that the tail stays a valid free block. Requires heap_lock.
+ *
+ * @param pad The number of free bytes to keep at the end of the heap.
+ * @return The number of bytes given back to the OS.
+ */
+size_t trim_tail(size_t pad) {
+    struct allocation_block* tail = allocation_tail;
+    pad = align(pad);
+    // Someone else may have moved the break since the tail was last extended.
+    if (!tail || !is_free(tail) || block_size(tail) <= pad || morecore(0) != (void*) next_block(tail)) {
+        return 0;
+    }
+    size_t released = block_size(tail) - pad;
+    if (morecore(-(intptr_t) released) == (void*) -1) {
+        return 0;
+    }
+    record_sbrk(-(intptr_t) released);
+    bin_remove(tail);
+    set_block(tail, pad, TRUE);
+    bin_insert(tail);
+    return released;
+}
+
+/**
+ * Gives the whole pages of a dirty free block back to the OS, and clears the rest of its data so that it's marked
+ * zeroed like fresh memory. MADV_DONTNEED is used rather than MADV_FREE since pages given back with MADV_FREE keep
+ * their old contents until the OS needs them. Requires heap_lock.
+ *
+ * @param block The free block, which must be in free_tree and out of its decay list.
+ * @return The number of bytes given back.
+ */
+size_t purge_block(struct allocation_block* block) {
+    uintptr_t page_size = getpagesize();
+    char* start = (char*) block_data(block) + FREE_LINKS_SIZE;
+    char* end = (char*) block_footer(block);
+    char* pages = (char*) (((uintptr_t) start + page_size - 1) & ~(page_size - 1));
+    char* pages_end = (char*) ((uintptr_t) end & ~(page_size - 1));
+    if (pages >= pages_end || madvise(pages, pages_end - pages, MADV_DONTNEED)) {
+        return 0;
+    }
+    memset(start, 0, pages - start);
+    memset(pages_end, 0, end - pages_end);
+    block->header |= ZEROED;
+    return pages_end - pages;
+}
+
+/**
+ * Moves every block in one decay list to the front of another, whose blocks were all freed later.
+ *
+ * @param from The sentinel of the list to empty.
+ * @param to The sentinel of the list to move the blocks to.
+ */
+void decay_list_splice(struct allocation_block* from, struct allocation_block* to) {
+    if (from->next_free == from) {
+        return;
+    }
+    from->previous_free->next_free = to->next_free;
+    to->next_free->previous_free = from->previous_free;
+    to->next_free = from->next_free;
+    from->next_free->previous_free = to;
+    from->next_free = from->previous_free = from;
+}
+
+/**
+ * Moves on to the steps of the decay time that have started by `now`, then purges the oldest list's blocks, which have
+ * waited a whole decay time, oldest first. At most DECAY_PURGE_LIMIT blocks are purged, and the rest are left for the
+ * next check, which is made on the next tick instead of a step later. Does nothing until the heap has started and set up
+ * the decay lists, which the decay thread can beat it to. Requires heap_lock.
+ *
+ * @param now The current time in milliseconds.
+ */
+void decay_purge(size_t now) {
+    if (!heap_started) {
+        return;
+    }
+    size_t step = decay_time / DECAY_STEPS;
+    step = step ? step : 1;
+    decay_next = decay_next ? decay_next : now + step;
+    for (int i = 0; i < DECAY_EPOCHS && now >= decay_next; i++) {
+        decay_epoch = (decay_epoch + 1) % DECAY_EPOCHS;
+        // The new step's list was the oldest, so whatever is left in it goes in front of the new oldest list.
+        decay_list_splice(&decay_lists[decay_epoch], &decay_lists[(decay_epoch + 1) % DECAY_EPOCHS]);
+        decay_next += step;
+    }
+    // After a long idle time every step has gone by, and the steps restart from now.
+    decay_next = now >= decay_next ? now + step : decay_next;
+    struct allocation_block* oldest = &decay_lists[(decay_epoch + 1) % DECAY_EPOCHS];
+    for (int purged = 0; oldest->next_free != oldest && purged < DECAY_PURGE_LIMIT; purged++) {
+        struct allocation_block* block = oldest->next_free;
+        decay_list_remove(block);
+        // Blocks carved out of fresh memory are marked zeroed after they are binned.
+        if (!(block->header & ZEROED)) {
+            decay_purged += purge_block(block);
+        }
+    }
+    __atomic_store_n(&decay_backlog, oldest->next_free != oldest, __ATOMIC_RELAXED);
+}
+
+/**
+ * Gives the free tail back to the OS once it grows past `trim_threshold`, keeping a growth step's worth of it so that
+ * the heap doesn't shrink and grow again on every free, and purges decayed blocks when a check is due. Requires
+ * heap_lock.
+ */
+void trim_if_needed() {
+    if (allocation_tail && is_free(allocation_tail) && block_size(allocation_tail) > trim_threshold + heap_growth) {
+        trim_tail(top_pad + heap_growth);
+    }
+    if (decay_time && !decay_ticks--) {
+        decay_ticks = DECAY_TICKS - 1;
+        size_t now = decay_clock();
+        if (now >= decay_next || decay_backlog) {
+            decay_purge(now);
+        }
+    }
+}
+
+/**
+ * Partitions an allocation_block and splits into left and right allocation_blocks, if the new right portion can hold at
+ * least MIN_DATA_SIZE bytes in addition to the size of the meta information. The right block is free and binned.
+ *
+ * @param left The allocation_block to split.
+ * @param size The required data size for the left block.
+ * @return The right allocation_block, or NULL if we aren't able to split.
+ */
+struct allocation_block* split_if_possible(struct allocation_block* left, size_t size) {
+    size_t right_size = block_size(left) - size;
+    if (right_size >= MIN_DATA_SIZE + META_SIZE) {
+        struct allocation_block* right = (void*) ((char*) block_data(left) + size);
+        right->header = HEAP_TAG << TAG_SHIFT | (is_free(left) ? left->header & ZEROED : PREVIOUS_IN_USE);
+        if (left == allocation_tail) {
+            allocation_tail = right;
+        }
+        set_block(left, size, is_free(left));
+        set_block(right, right_size - META_SIZE, TRUE);
+        bin_insert(right);
+        return right;
+    }
+    return NULL;
+}
+
+/**
+ * Keeps `left`'s zeroed flag through merging with the free block `right` after it only if both are zeroed, clearing
+ * the footer, header and bin links left between them. Must be called before they are merged.
+ *
+ * @param left The block being merged into.
+ * @param right The free block being absorbed.
+ */
+void merge_zeroed(struct allocation_block* left, struct allocation_block* right) {
+    if (left->header & right->header & ZEROED) {
+        size_t links_size = block_size(right) < FREE_LINKS_SIZE ? block_size(right) : FREE_LINKS_SIZE;
+        memset(block_footer(left), 0, sizeof(size_t) + META_SIZE + links_size);
+    } else {
+        left->header &= ~(size_t) ZEROED;
+    }
+}
+
+/**
+ * merge_free_right is the same as `merge_adjacent_free` but it only merges with the right block when avaliable. Since
+ * the pointer to the merged block will be the same with and without merging, nothing is returned. The block is not
+ * (re)binned.
+ *
+ * @param block The block to merge with the right block.
+ */
+void merge_free_right(struct allocation_block* block) {
+    if (block == allocation_tail || !is_free(next_block(block))) {
+        return;
+    }
+    struct allocation_block* right = next_block(block);
+    bin_remove(right);
+    if (right == allocation_tail) {
+        allocation_tail = block;
+    }
+    size_t size = block_size(block) + META_SIZE + block_size(right);
+    merge_zeroed(block, right);
+    right->header = 0;
+    set_block(block, size, is_free(block));
+}
+
+/**
+ * Merges the current block with surrounding blocks if available and returns a pointer to the merged block. If the
+ * current block is not free, the merged block is guaranteed to have the same data as the original block after merging.
+ * Absorbed neighbours are taken out of their bins, and the merged block is binned if the current block is free.
+ *
+ * @param block The block to merge with adjacent blocks.
+ * @return A pointer to the merged block.
+ */
+struct allocation_block* merge_adjacent_free(struct allocation_block* block) {
+    int free = is_free(block);
+    if (!(block->header & PREVIOUS_IN_USE)) {
+        struct allocation_block* left = previous_block(block);
+        bin_remove(left);
+        if (block == allocation_tail) {
+            allocation_tail = left;
+        }
+        size_t size = block_size(block);
+        if (free) {
+            merge_zeroed(left, block);
+        }
+        block->header = 0;
+        if (!free) {
+            memmove(block_data(left), block_data(block), size);
+        }
+        set_block(left, block_size(left) + META_SIZE + size, free);
+        block = left;
+    }
+    merge_free_right(block);
+    if (free) {
+        bin_insert(block);
+    }
+    return block;
+}
+
+/**
+ * Grows the heap for a new block of data size `size`, by a step from `growth_size`. The block is carved out of the start
+ * of the new space, and the rest is left as a free tail for later allocations to be carved out of without growing the
+ * heap again.
+ *
+ * @param size The size needed for the allocation block.
+ * @param dirty_size Set to the number of bytes at the start of the block's data that may not be zero, if not NULL.
+ * @return The allocation block, or NULL if sbrk failed or the heap can't grow contiguously.
+ */
+struct allocation_block* request_space(size_t size, size_t* dirty_size) {
+    size_t grown_size = growth_size(size);
+    size_t dirty;
+    struct allocation_block* block = request_exact_space(grown_size, &dirty);
+    if (!block && grown_size > size) {
+        block = request_exact_space(size, &dirty);
+    }
+    if (!block) {
+        return NULL;
+    }
+    struct allocation_block* rest = split_if_possible(block, size);
+    // Fresh memory is zero, so the rest is zeroed unless the dirty part of the new space reaches into it.
+    if (rest && dirty <= size) {
+        rest->header |= ZEROED;
+    }
+    if (dirty_size) {
+        *dirty_size = dirty < size ? dirty : size;
+    }
+    return block;
+}
+
+/**
+ * Takes the best-fitting free block for `size` out of its bin, or requests space for a new one. Requires heap_lock.
+ *
+ * @param size The aligned data size needed.
+ * @param dirty_size Set to the number of bytes at the start of the block's data that may not be zero, if not NULL.
+ * @return The allocated block, or NULL if sbrk failed.
+ */
+struct allocation_block* allocate_block(size_t size, size_t* dirty_size) {
+    struct allocation_block* allocated_block = find_free_block_best_fit(size);
+    if (allocated_block) {
+        bin_remove(allocated_block);
+        // Split while still free, so that the remainder keeps the zeroed flag.
+        split_if_possible(allocated_block, size);
+        size_t dirty = block_size(allocated_block);
+        if (allocated_block->header & ZEROED) {
+            *block_footer(allocated_block) = 0;
+            dirty = FREE_LINKS_SIZE;
+        }
+        if (dirty_size) {
+            *dirty_size = dirty;
+        }
+        set_block(allocated_block, block_size(allocated_block), FALSE);
+        return allocated_block;
+    }
+    // Allocate a new block.
+    return request_space(size, dirty_size);
+}
+
+/**
+ * Splits an allocated block into `count` allocated blocks of data size `size`, writing each header directly rather than
+ * splitting off and binning a remainder each time. The last block keeps whatever is left over. Requires heap_lock.
+ *
+ * @param block The allocated block to carve, of data size at least `count * (META_SIZE + size) - META_SIZE`.
+ * @param size The aligned data size of each block.
+ * @param count The number of blocks to carve, at least 1.
+ * @param blocks The array to store the carved blocks into.
+ */
+void carve_blocks(struct allocation_block* block, size_t size, size_t count, struct allocation_block** blocks) {
+    int is_tail = block == allocation_tail;
+    size_t remaining = block_size(block);
+    for (size_t i = 0; i < count - 1; i++) {
+        struct allocation_block* next = (struct allocation_block*) ((char*) block_data(block) + size);
+        next->header = HEAP_TAG << TAG_SHIFT | PREVIOUS_IN_USE;
+        block->header = (block->header & ~SIZE_MASK) | size;
+        remaining -= META_SIZE + size;
+        blocks[i] = block;
+        block = next;
+    }
+    block->header = (block->header & ~SIZE_MASK) | remaining;
+    blocks[count - 1] = block;
+    if (is_tail) {
+        allocation_tail = block;
+    }
+}
+
+/**
+ * Allocates up to `count` blocks of data size `size` into `blocks`. Free blocks are used first, and the rest are carved
+ * out of a single request for space. Requires heap_lock.
+ *
+ * @param size The aligned data size of each block.
+ * @param count The number of blocks wanted.
+ * @param blocks The array to store the allocated blocks into.
+ * @return The number of blocks allocated, less than `count` only if sbrk failed.
+ */
+int allocate_blocks(size_t size, int count, struct allocation_block** blocks) {
+    int allocated = 0;
+    struct allocation_block* block;
+    while (allocated < count && (block = find_free_block_best_fit(size))) {
+        bin_remove(block);
+        split_if_possible(block, size);
+        set_block(block, block_size(block), FALSE);
+        blocks[allocated++] = block;
+    }
+    if (allocated < count && (block = request_space((count - allocated) * (META_SIZE + size) - META_SIZE, NULL))) {
+        carve_blocks(block, size, count - allocated, blocks + allocated);
+        allocated = count;
+    }
+    return allocated;
+}
+
+/**
+ * Marks a block as free and merges it into its neighbours. Requires heap_lock.
+ *
+ * @param block The allocated block to release.
+ */
+void release_block(struct allocation_block* block) {
+    set_block(block, block_size(block), TRUE);
+    merge_adjacent_free(block);
+    trim_if_needed();
+}
+
+/**
+ * Resizes an allocated block to data size `size`, moving the data if it can't be done in place. A block that has to
+ * move is given headroom of half its old size, so that a buffer grown a little at a time is copied O(1) times per byte
+ * on average. Requires heap_lock.
+ *
+ * @param target_block The allocated block to resize.
+ * @param size The aligned data size to change to.
+ * @return The resized block, or NULL if sbrk failed.
+ */
+struct allocation_block* resize_block(struct allocation_block* target_block, size_t size) {
+    size_t current_size = block_size(target_block);
+    // Shrinking a little keeps any headroom, so a buffer that is trimmed and regrown doesn't split and merge each time.
+    if (size <= current_size && current_size - size <= size / 2) {
+        return target_block;
+    }
+    size_t leftAvailable =
+            target_block->header & PREVIOUS_IN_USE ? 0 : META_SIZE + block_size(previous_block(target_block));
+    size_t rightAvailable = target_block != allocation_tail && is_free(next_block(target_block))
+            ? META_SIZE + block_size(next_block(target_block)) : 0;
+    size_t grown_size = align(current_size + current_size / 2);
+    if (grown_size < size || grown_size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        grown_size = size;
+    }
+
+    // When reallocating a block, here are the priorities that we will partition by.
+    // 1. Reuse (current block + extend right).
+    //    Since merging with right is an O(1) operation, we can preemptively merge with the right block and then
+    //    repartition over just partitioning the current block to avoid 2 consecutive free blocks to the right,
+    //    limiting fragmentation. If there isn't a next block (i.e: the current block is the tail), we can simply extend
+    //    sbrk, to be as efficient as possible.
+    // 2. Reuse all adjacent blocks.
+    //    Since merging with left is an O(size) operation, we should merge with left only when we can't do (1).
+    // 3. Push a new tail onto the allocation blocks.
+    //    Since this has the same time complexity as (2) but (2) limits fragmentation, we should only do this when all
+    //    other options can't be chosen.
+    // The data only moves in (2) and (3), so only they take headroom.
+    if (rightAvailable + current_size >= size) {
+        merge_free_right(target_block);
+        split_if_possible(target_block, size);
+        return target_block;
+    } else if (target_block == allocation_tail) {
+        // The data stays put, so the tail grows by a heap growth step rather than taking headroom.
+        size_t tail_growth = growth_size(size);
+        if (!extend_tail(tail_growth) && (tail_growth == size || !extend_tail(size))) {
+            return NULL;
+        }
+        // What is left over becomes the free tail.
+        split_if_possible(target_block, size);
+        return target_block;
+    } else if (leftAvailable + rightAvailable + current_size >= size) {
+        target_block = merge_adjacent_free(target_block);
+        split_if_possible(target_block, block_size(target_block) >= grown_size ? grown_size : size);
+        return target_block;
+    } else {
+        // size is guaranteed to be greater than target_block's size.
+        struct allocation_block* new_block = allocate_block(grown_size, NULL);
+        if (new_block) {
+            memcpy(block_data(new_block), block_data(target_block), current_size);
+            release_block(target_block);
+        }
+        return new_block;
+    }
+}
+
+/**
+ * Allocates a heap block of data size `size` whose data starts at a multiple of `alignment`. A bigger block is allocated
+ * and the padding on either side of the aligned block is split off and freed again. Requires heap_lock.
+ *
+ * @param alignment The alignment needed, a power of two greater than ALIGNMENT.
+ * @param size The aligned data size needed.
+ * @return The allocated block, or NULL if sbrk failed.
+ */
+struct allocation_block* allocate_aligned_block(size_t alignment, size_t size) {
+    struct allocation_block* block = allocate_block(align(size + alignment + META_SIZE + MIN_DATA_SIZE), NULL);
+    if (!block) {
+        return NULL;
+    }
+    uintptr_t data = (uintptr_t) block_data(block);
+    if (data % alignment) {
+        // The leading padding must be big enough to be a free block of its own.
+        uintptr_t aligned_data = (data + META_SIZE + MIN_DATA_SIZE + alignment - 1) & ~(uintptr_t) (alignment - 1);
+        struct allocation_block* leading = block;
+        block = split_if_possible(leading, aligned_data - META_SIZE - data);
+        bin_remove(block);
+        set_block(block, block_size(block), FALSE);
+        set_block(leading, block_size(leading), TRUE);
+        merge_adjacent_free(leading);
+    }
+    // allocate_block may already have left a free block after this one, which the trailing padding joins.
+    struct allocation_block* trailing = split_if_possible(block, size);
+    if (trailing) {
+        bin_remove(trailing);
+        merge_free_right(trailing);
+        bin_insert(trailing);
+    }
+    return block;
+}
+
+/**
+ * Switches an allocated heap block's tag between HEAP_TAG and TCACHE_TAG as it enters or leaves a thread cache. The
+ * other bits of the header may be changed under heap_lock at the same time, so the tag is flipped atomically.
+ *
+ * @param block The allocated heap block to switch.
+ */
+void toggle_cache_tag(struct allocation_block* block) {
+    __atomic_fetch_xor(&block->header, (HEAP_TAG ^ TCACHE_TAG) << TAG_SHIFT, __ATOMIC_RELAXED);
+#ifdef __DEBUG__
+    // Cached blocks don't hold a request, so none of their space is counted as internal fragmentation. `malloc` sets
+    // the real requested size when the block leaves the cache.
+    block->requested_size = block_size(block);
+#endif
+}
+
+/**
+ * Finds the slab that a small object belongs to from its page, or NULL if `ptr` isn't a slab object.
+ *
+ * @param ptr The pointer to check.
+ * @return The slab holding the object at `ptr`, or NULL if there isn't one.
+ */
+struct slab* find_slab_for_allocation(void* ptr) {
+    char* region = __atomic_load_n(&slab_region, __ATOMIC_ACQUIRE);
+    if (!region || (char*) ptr < region || (char*) ptr >= region + SLAB_REGION_SIZE) {
+        return NULL;
+    }
+    struct slab* slab = (struct slab*) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_SIZE - 1));
+    size_t offset = (char*) ptr - slab_objects(slab);
+    if (slab->magic != SLAB_MAGIC || (char*) ptr < slab_objects(slab) || offset % slab->object_size
+            || offset / slab->object_size >= slab->capacity) {
+        return NULL;
+    }
+    return slab;
+}
+
+/**
+ * Takes a page out of the slab region and sets it up as an empty slab for objects of size `object_size`.
+ *
+ * @param object_size The size of each object in the slab.
+ * @return The new slab, or NULL if the slab region couldn't be mapped or is exhausted.
+ */
+struct slab* slab_create(size_t object_size) {
+    pthread_mutex_lock(&slab_region_lock);
+    struct slab* slab = free_slabs;
+    if (slab) {
+        free_slabs = slab->next;
+    } else {
+        if (!slab_region) {
+            // Reserve the whole region up front so that slab objects can be recognized by their address alone. Pages
+            // only take up memory once they are touched.
+            void* region = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (region != MAP_FAILED) {
+                __atomic_store_n(&slab_region, region, __ATOMIC_RELEASE);
+            }
+        }
+        if (slab_region && slab_region_used < SLAB_REGION_SIZE) {
+            slab = (struct slab*) (slab_region + slab_region_used);
+            slab_region_used += SLAB_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&slab_region_lock);
+    if (!slab) {
+        return NULL;
+    }
+    slab->next = NULL;
+    slab->previous = NULL;
+    slab->object_size = object_size;
+    slab->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / object_size;
+    slab->used = 0;
+    slab->owner = NULL;
+    slab->remote_free = SLAB_ABANDONED;
+    for (unsigned int word = 0; word < SLAB_BITMAP_WORDS; word++) {
+        unsigned int bits = slab->capacity - word * 64;
+        slab->free_bitmap[word] = word * 64 >= slab->capacity ? 0 : bits >= 64 ? ~0UL : (1UL << bits) - 1;
+    }
+    slab->magic = SLAB_MAGIC;
+    return slab;
+}
+
+/**
+ * Unlinks a slab from its class's list of slabs with free slots. Requires the class's lock.
+ *
+ * @param slab_class The class that the slab belongs to.
+ * @param slab The slab to unlink.
+ */
+void slab_unlink(struct slab_class* slab_class, struct slab* slab) {
+    if (slab->previous) {
+        slab->previous->next = slab->next;
+    } else {
+        slab_class->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->previous = slab->previous;
+    }
+}
+
+/**
+ * Takes up to `count` objects out of a slab into `objects`, using the first free slots of its bitmap. Requires the
+ * class's lock, or owning the slab.
+ *
+ * @param slab The slab to take objects from.
+ * @param count The number of objects wanted.
+ * @param objects The array to store the objects into.
+ * @return The number of objects taken, less than `count` only if the slab is full.
+ */
+int slab_take(struct slab* slab, int count, void** objects) {
+    int taken = 0;
+    for (unsigned int word = 0; word < SLAB_BITMAP_WORDS && taken < count; word++) {
+        while (slab->free_bitmap[word] && taken < count) {
+            unsigned int bit = __builtin_ctzl(slab->free_bitmap[word]);
+            slab->free_bitmap[word] &= slab->free_bitmap[word] - 1;
+            slab->used++;
+            objects[taken++] = slab_objects(slab) + (word * 64 + bit) * slab->object_size;
+        }
+    }
+    return taken;
+}
+
+/**
+ * Allocates up to `count` objects from the slabs on a class's list, under the class's lock. Used by threads that can't
+ * own slabs, such as exiting ones.
+ *
+ * @param slab_class The class to allocate from.
+ * @param count The number of objects wanted.
+ * @param objects The array to store the allocated objects into.
+ * @return The number of objects allocated, less than `count` only if the slab region is exhausted.
+ */
+int slab_allocate_shared(struct slab_class* slab_class, int count, void** objects) {
+    int allocated = 0;
+    pthread_mutex_lock(&slab_class->lock);
+    while (allocated < count) {
+        struct slab* slab = slab_class->partial;
+        if (!slab) {
+            slab = slab_create((slab_class - slab_classes + 1) * ALIGNMENT);
+            if (!slab) {
+                break;
+            }
+            slab_class->partial = slab;
+            slab_class->slabs++;
+        }
+        allocated += slab_take(slab, count - allocated, objects + allocated);
+        if (slab->used == slab->capacity) {
+            slab_unlink(slab_class, slab);
+        }
+    }
+    pthread_mutex_unlock(&slab_class->lock);
+    __atomic_add_fetch(&slab_class->objects, allocated, __ATOMIC_RELAXED);
+    return allocated;
+}
+
+/**
+ * Marks an object's slot in its slab as free. Requires the class's lock, or owning the slab.
+ *
+ * @param slab The slab holding the object.
+ * @param ptr The object to free.
+ * @return TRUE if the slot was freed, or FALSE if it was free already.
+ */
+int slab_mark_free(struct slab* slab, void* ptr) {
+    size_t slot = ((char*) ptr - slab_objects(slab)) / slab->object_size;
+    unsigned long bit = 1UL << (slot % 64);
+    // Ignore double frees.
+    if (slab->free_bitmap[slot / 64] & bit) {
+        return FALSE;
+    }
+    slab->free_bitmap[slot / 64] |= bit;
+    slab->used--;
+    __atomic_sub_fetch(&slab_class_for(slab->object_size)->objects, 1, __ATOMIC_RELAXED);
+    return TRUE;
+}
+
+/**
+ * Moves the objects that other threads freed into a slab owned by the calling thread back into its bitmap, taking the
+ * whole list at once.
+ *
+ * @param slab The owned slab.
+ * @return The number of objects reclaimed.
+ */
+int slab_reclaim(struct slab* slab) {
+    void* ptr = __atomic_exchange_n(&slab->remote_free, NULL, __ATOMIC_ACQUIRE);
+    int reclaimed = 0;
+    // A double free may have linked an object in twice, so no more than a slab's worth of objects are followed.
+    for (unsigned int followed = 0; ptr && followed < slab->capacity; followed++) {
+        void* next = *(void**) ptr;
+        reclaimed += slab_mark_free(slab, ptr);
+        ptr = next;
+    }
+    return reclaimed;
+}
+
+/**
+ * Gives an empty slab back to the slab region for reuse by any class. Requires the class's lock.
+ *
+ * @param slab_class The class that the slab belongs to.
+ * @param slab The empty slab, on no list.
+ */
+void slab_recycle(struct slab_class* slab_class, struct slab* slab) {
+    slab_class->slabs--;
+    slab->magic = 0;
+    pthread_mutex_lock(&slab_region_lock);
+    slab->next = free_slabs;
+    free_slabs = slab;
+    pthread_mutex_unlock(&slab_region_lock);
+}
+
+/**
+ * Gives up the calling thread's ownership of a slab, so that frees into it go through the class's lock again. A slab
+ * with free slots goes back on its class's list, or back to the slab region if it's empty and the class has others.
+ * Requires the class's lock.
+ *
+ * @param slab_class The class that the slab belongs to.
+ * @param slab The owned slab.
+ */
+void slab_abandon(struct slab_class* slab_class, struct slab* slab) {
+    __atomic_store_n(&slab->owner, NULL, __ATOMIC_RELAXED);
+    void* expected = NULL;
+    // Nobody would reclaim objects pushed after this, so the list is only closed once it's empty.
+    while (!__atomic_compare_exchange_n(&slab->remote_free, &expected, SLAB_ABANDONED, FALSE, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED)) {
+        slab_reclaim(slab);
+        expected = NULL;
+    }
+    if (!slab->used && slab_class->partial) {
+        slab_recycle(slab_class, slab);
+    } else if (slab->used < slab->capacity) {
+        slab->previous = NULL;
+        slab->next = slab_class->partial;
+        if (slab->next) {
+            slab->next->previous = slab;
+        }
+        slab_class->partial = slab;
+    }
+}
+
+/**
+ * Frees an object into its slab without taking a lock: straight into the bitmap if the calling thread owns the slab, or
+ * pushed onto the slab's list of remote frees for its owner to reclaim otherwise. Remote frees still count as in use
+ * until they are reclaimed.
+ *
+ * @param slab The slab holding the object.
+ * @param ptr The object to free.
+ * @return TRUE if the object was freed, or FALSE if the slab has no owner, so that it has to be freed under the class's
+ *     lock with `slab_release`.
+ */
+int slab_free_owned(struct slab* slab, void* ptr) {
+    if (__atomic_load_n(&slab->owner, __ATOMIC_RELAXED) == &thread_cache) {
+        slab_mark_free(slab, ptr);
+        return TRUE;
+    }
+    void* head = __atomic_load_n(&slab->remote_free, __ATOMIC_RELAXED);
+    do {
+        if (head == SLAB_ABANDONED) {
+            return FALSE;
+        }
+        *(void**) ptr = head;
+    } while (!__atomic_compare_exchange_n(&slab->remote_free, &head, ptr, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return TRUE;
+}
+
+/**
+ * Frees an object back into a slab without an owner. A slab that becomes empty goes back to the slab region for reuse
+ * by any class, unless it's the only slab of its class with free slots. Requires the class's lock.
+ *
+ * @param slab The slab holding the object.
+ * @param ptr The object to free.
+ * @return TRUE if the object was freed, or FALSE if a thread took ownership of the slab in the meantime, so that it has
+ *     to be freed with `slab_free_owned`.
+ */
+int slab_release(struct slab* slab, void* ptr) {
+    struct slab_class* slab_class = slab_class_for(slab->object_size);
+    if (__atomic_load_n(&slab->remote_free, __ATOMIC_ACQUIRE) != SLAB_ABANDONED) {
+        return FALSE;
+    }
+    if (!slab_mark_free(slab, ptr)) {
+        return TRUE;
+    }
+    if (slab->used == slab->capacity - 1) {
+        slab->previous = NULL;
+        slab->next = slab_class->partial;
+        if (slab->next) {
+            slab->next->previous = slab;
+        }
+        slab_class->partial = slab;
+    }
+    if (!slab->used && (slab->previous || slab->next)) {
+        slab_unlink(slab_class, slab);
+        slab_recycle(slab_class, slab);
+    }
+    return TRUE;
+}
+
+/**
+ * Frees an object back into its slab, taking the class's lock only if the slab has no owner.
+ *
+ * @param slab The slab holding the object.
+ * @param ptr The object to free.
+ */
+void slab_free(struct slab* slab, void* ptr) {
+    struct slab_class* slab_class = slab_class_for(slab->object_size);
+    int freed = slab_free_owned(slab, ptr);
+    while (!freed) {
+        pthread_mutex_lock(&slab_class->lock);
+        freed = slab_release(slab, ptr) || slab_free_owned(slab, ptr);
+        pthread_mutex_unlock(&slab_class->lock);
+    }
+}
+
+/**
+ * Releases the first `count` objects in one of the calling thread's cache bins back to their slabs or the heap.
+ *
+ * @param index The cache bin to flush.
+ * @param count The number of objects to flush.
+ */
+void thread_cache_flush(size_t index, int count) {
+    struct slab_class* slab_class = index * 8 % ALIGNMENT == 0 && index * 8 <= SLAB_MAX_SIZE
+            ? slab_class_for(index * 8) : NULL;
+    int heap_locked = FALSE;
+    int slab_locked = FALSE;
+    for (; count > 0 && thread_cache.bins[index]; count--) {
+        void* ptr = thread_cache.bins[index];
+        thread_cache.bins[index] = *(void**) ptr;
+        thread_cache.counts[index]--;
+        struct slab* slab = find_slab_for_allocation(ptr);
+        // Only one lock is held at a time, so that flushes can't deadlock with each other or with `prepare_fork`. Slabs
+        // with an owner take no lock at all.
+        if (slab) {
+            if (slab_free_owned(slab, ptr)) {
+                continue;
+            }
+            if (heap_locked) {
+                pthread_mutex_unlock(&heap_lock);
+                heap_locked = FALSE;
+            }
+            if (!slab_locked) {
+                pthread_mutex_lock(&slab_class->lock);
+                slab_locked = TRUE;
+            }
+            // Under the lock, the slab can only have gained an owner since.
+            if (!slab_release(slab, ptr)) {
+                slab_free_owned(slab, ptr);
+            }
+        } else {
+            if (slab_locked) {
+                pthread_mutex_unlock(&slab_class->lock);
+                slab_locked = FALSE;
+            }
+            if (!heap_locked) {
+                pthread_mutex_lock(&heap_lock);
+                heap_locked = TRUE;
+            }
+            struct allocation_block* block = data_block(ptr);
+            toggle_cache_tag(block);
+            release_block(block);
+        }
+    }
+    if (slab_locked) {
+        pthread_mutex_unlock(&slab_class->lock);
+    }
+    if (heap_locked) {
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+/**
+ * Releases every object in the calling thread's cache and stops caching. Runs on thread exit.
+ *
+ * @param cache The calling thread's cache.
+ */
+void thread_cache_flush_all(void* cache) {
+    (void) cache;
+    thread_cache.shutting_down = TRUE;
+    for (size_t index = 0; index < TCACHE_BIN_COUNT; index++) {
+        thread_cache_flush(index, thread_cache.counts[index]);
+    }
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        if (thread_cache.slabs[i]) {
+            pthread_mutex_lock(&slab_classes[i].lock);
+            slab_abandon(&slab_classes[i], thread_cache.slabs[i]);
+            pthread_mutex_unlock(&slab_classes[i].lock);
+            thread_cache.slabs[i] = NULL;
+        }
+    }
+}
+
+/**
+ * Creates the thread-specific key whose destructor flushes a thread's cache.
+ */
+void thread_cache_create_key() {
+    pthread_key_create(&thread_cache_key, thread_cache_flush_all);
+}
+
+/**
+ * Stores the calling thread's cache in the thread-specific key, so that `thread_cache_flush_all` runs on thread exit.
+ */
+void thread_cache_register() {
+    pthread_once(&thread_cache_key_once, thread_cache_create_key);
+    thread_cache.registered = TRUE;
+    pthread_setspecific(thread_cache_key, &thread_cache);
+}
+
+/**
+ * Allocates up to `count` objects of size `object_size` from the slab of their class that the calling thread owns,
+ * without a lock. Once the slab is full, the objects that other threads freed into it are reclaimed, and only if there
+ * are none is it swapped for another slab of the class under the class's lock.
+ *
+ * @param object_size The size of each object, a multiple of ALIGNMENT up to SLAB_MAX_SIZE.
+ * @param count The number of objects wanted.
+ * @param objects The array to store the allocated objects into.
+ * @return The number of objects allocated, less than `count` only if the slab region is exhausted.
+ */
+int slab_allocate(size_t object_size, int count, void** objects) {
+    struct slab_class* slab_class = slab_class_for(object_size);
+    if (!thread_cache.registered && !thread_cache.shutting_down) {
+        thread_cache_register();
+    }
+    // An exiting thread can't own slabs any more, since nothing would give them up.
+    if (thread_cache.shutting_down) {
+        return slab_allocate_shared(slab_class, count, objects);
+    }
+    struct slab** owned = &thread_cache.slabs[slab_class - slab_classes];
+    int allocated = 0;
+    while (allocated < count) {
+        if (*owned) {
+            allocated += slab_take(*owned, count - allocated, objects + allocated);
+            if (allocated == count || slab_reclaim(*owned)) {
+                continue;
+            }
+        }
+        pthread_mutex_lock(&slab_class->lock);
+        if (*owned) {
+            slab_abandon(slab_class, *owned);
+        }
+        struct slab* slab = slab_class->partial;
+        if (slab) {
+            slab_unlink(slab_class, slab);
+        } else if ((slab = slab_create(object_size))) {
+            slab_class->slabs++;
+        }
+        if (slab) {
+            __atomic_store_n(&slab->owner, &thread_cache, __ATOMIC_RELAXED);
+            __atomic_store_n(&slab->remote_free, NULL, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&slab_class->lock);
+        *owned = slab;
+        if (!slab) {
+            break;
+        }
+    }
+    __atomic_add_fetch(&slab_class->objects, allocated, __ATOMIC_RELAXED);
+    return allocated;
+}
+
+/**
+ * Pops an object of size `size` from the calling thread's cache, refilling the cache's bin with a batch of objects from
+ * the slabs or the heap when it is empty.
+ *
+ * @param size The slab object size or aligned data size needed, at most TCACHE_MAX_SIZE.
+ * @return The cached object, or NULL if caching is disabled or no memory is left.
+ */
+void* thread_cache_get(size_t size) {
+    size_t index = size / 8;
+    if (!thread_cache.bins[index]) {
+        int refill_count = __atomic_load_n(&tcache_count, __ATOMIC_RELAXED);
+        refill_count = refill_count < TCACHE_BATCH ? refill_count : TCACHE_BATCH;
+        if (!refill_count || thread_cache.shutting_down) {
+            return NULL;
+        }
+        if (!thread_cache.registered) {
+            thread_cache_register();
+        }
+        void* objects[TCACHE_BATCH];
+        int allocated;
+        if (size <= __atomic_load_n(&slab_max_size, __ATOMIC_RELAXED)) {
+            allocated = slab_allocate(size, refill_count, objects);
+        } else {
+            struct allocation_block* blocks[TCACHE_BATCH];
+            pthread_mutex_lock(&heap_lock);
+            allocated = allocate_blocks(size, refill_count, blocks);
+            pthread_mutex_unlock(&heap_lock);
+            for (int i = 0; i < allocated; i++) {
+                toggle_cache_tag(blocks[i]);
+                objects[i] = block_data(blocks[i]);
+            }
+        }
+        for (int i = allocated - 1; i >= 0; i--) {
+            *(void**) objects[i] = thread_cache.bins[index];
+            thread_cache.bins[index] = objects[i];
+        }
+        thread_cache.counts[index] = allocated;
+        if (!allocated) {
+            return NULL;
+        }
+    }
+    void* ptr = thread_cache.bins[index];
+    thread_cache.bins[index] = *(void**) ptr;
+    thread_cache.counts[index]--;
+    if (!find_slab_for_allocation(ptr)) {
+        toggle_cache_tag(data_block(ptr));
+    }
+    return ptr;
+}
+
+/**
+ * Pushes an object onto the calling thread's cache, flushing a batch back when the bin is over its limit. Objects are
+ * linked through their first 8 bytes.
+ *
+ * @param ptr The allocated object to cache.
+ * @param size The slab object size or block data size of `ptr`, at most TCACHE_MAX_SIZE.
+ * @return TRUE if the object was cached, or FALSE if caching is disabled.
+ */
+int thread_cache_put(void* ptr, size_t size) {
+    int limit = __atomic_load_n(&tcache_count, __ATOMIC_RELAXED);
+    if (!limit || thread_cache.shutting_down) {
+        return FALSE;
+    }
+    // A thread that only frees, like a consumer, must still flush its cache when it exits.
+    if (!thread_cache.registered) {
+        thread_cache_register();
+    }
+    size_t index = size / 8;
+    if (!find_slab_for_allocation(ptr)) {
+        // Cached blocks are still allocated as far as the heap is concerned, so a different tag is what catches a double
+        // free.
+        toggle_cache_tag(data_block(ptr));
+    }
+    *(void**) ptr = thread_cache.bins[index];
+    thread_cache.bins[index] = ptr;
+    if (++thread_cache.counts[index] > limit) {
+        thread_cache_flush(index, thread_cache.counts[index] - limit + TCACHE_BATCH / 2);
+    }
+    return TRUE;
+}
+
+/**
+ * Attaches a heap profile sample of the calling stack to an allocated heap or mapped block, in the block's last word.
+ * Must not be called under heap_lock, since capturing the stack may allocate.
+ *
+ * @param block The allocated block, with a word to spare after the size that was asked for.
+ * @param size The size that was asked for.
+ */
+void sample_block(struct allocation_block* block, size_t size) {
+    struct profile_sample* sample = profile_sample_create(size);
+    if (sample) {
+        block_sample(block) = sample;
+        // Neighbours change this header's flags under heap_lock, so the bit is set atomically.
+        __atomic_fetch_or(&block->header, (size_t) SAMPLED, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Drops an allocated block's heap profile sample, if it has one, before the block is freed or resized.
+ *
+ * @param block The allocated heap or mapped block.
+ */
+void unsample_block(struct allocation_block* block) {
+    if (block->header & SAMPLED) {
+        __atomic_fetch_and(&block->header, ~(size_t) SAMPLED, __ATOMIC_RELAXED);
+        profile_sample_destroy(block_sample(block));
+    }
+}
+
+/**
+ * Allocates some memory of size `size` like `allocate`, and finds out how much of it may not be zero. Fresh memory from
+ * the OS is zero, so `calloc` only has to clear memory that is being reused.
+ *
+ * @param size The size of the block to allocate.
+ * @param dirty_size Set to the number of bytes at the start of the memory that may not be zero.
+ * @return A pointer to the start of the block of memory, or NULL if no memory is left.
+ */
+void* allocate_with_dirty_size(size_t size, size_t* dirty_size) {
+    if (size <= 0) {
+        return NULL;
+    }
+    *dirty_size = size;
+    // Sampled allocations need a header to be found by and a word to hold their sample, so they skip the slabs and the
+    // thread cache.
+    int sampled = profile_should_sample(size);
+    int use_slab = !sampled && size <= __atomic_load_n(&slab_max_size, __ATOMIC_RELAXED);
+    size_t aligned_size = use_slab ? (size + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1)
+            : align(sampled ? size + sizeof(struct profile_sample*) : size);
+    void* ptr = !sampled && aligned_size <= TCACHE_MAX_SIZE ? thread_cache_get(aligned_size) : NULL;
+    if (ptr && find_slab_for_allocation(ptr)) {
+        return ptr;
+    }
+    if (!ptr && use_slab) {
+        if (slab_allocate(aligned_size, 1, &ptr)) {
+            return ptr;
+        }
+        // The slab region is exhausted, so fall back to the heap.
+        aligned_size = align(size);
+    }
+    struct allocation_block* allocated_block = ptr ? data_block(ptr) : NULL;
+    if (!allocated_block && aligned_size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        allocated_block = map_block(aligned_size);
+        if (!allocated_block) {
+            return NULL;
+        }
+        *dirty_size = 0;
+    } else if (!allocated_block) {
+        pthread_mutex_lock(&heap_lock);
+        allocated_block = allocate_block(aligned_size, dirty_size);
+        pthread_mutex_unlock(&heap_lock);
+        // The heap can't grow once its reserved region is full or sbrk fails, but the system may still have memory.
+        if (!allocated_block) {
+            allocated_block = map_block(aligned_size);
+            if (!allocated_block) {
+                return NULL;
+            }
+            *dirty_size = 0;
+        }
+    }
+#ifdef __DEBUG__
+    allocated_block->requested_size = size;
+#endif
+    if (sampled) {
+        sample_block(allocated_block, size);
+    }
+    return block_data(allocated_block);
+}
+
+/**
+ * Allocates some memory of size `size`, like `malloc` but without tracing the call.
+ *
+ * @param size The size of the block to allocate.
+ * @return A pointer to the start of the block of memory, or NULL if no memory is left.
+ */
+void* allocate(size_t size) {
+    size_t dirty_size;
+    return allocate_with_dirty_size(size, &dirty_size);
+}
+
+/**
+ * Frees an allocated block of memory that isn't a slab object.
+ *
+ * @param ptr The pointer returned by `*alloc`.
+ */
+void deallocate_block(void* ptr) {
+    struct allocation_block* block = find_allocation_block_for_allocation(ptr);
+    // Ignore pointers that weren't returned by `*alloc`, and blocks that are already free.
+    if (!block || is_free(block)) {
+        return;
+    }
+    unsample_block(block);
+    if (block_tag(block) == MMAP_TAG) {
+        unmap_block(block);
+        return;
+    }
+    if (block_size(block) <= TCACHE_MAX_SIZE && thread_cache_put(ptr, block_size(block))) {
+        return;
+    }
+    pthread_mutex_lock(&heap_lock);
+    release_block(block);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/**
+ * Frees an allocated block of memory, like `free` but without tracing the call.
+ *
+ * @param ptr The pointer returned by `*alloc`.
+ */
+void deallocate(void* ptr) {
+    struct slab* slab = find_slab_for_allocation(ptr);
+    if (slab) {
+        if (!thread_cache_put(ptr, slab->object_size)) {
+            slab_free(slab, ptr);
+        }
+        return;
+    }
+    deallocate_block(ptr);
+}
+
+#ifdef __DEBUG__
+/**
+ * Checks that the size given to a sized free is the size that was asked for. Pointers that `free` would ignore pass.
+ *
+ * @param ptr The pointer being freed.
+ * @param size The size given for it.
+ * @return TRUE if the size matches, or FALSE otherwise.
+ */
+int sized_free_matches(void* ptr, size_t size) {
+    struct slab* slab = find_slab_for_allocation(ptr);
+    if (slab) {
+        return size <= slab->object_size;
+    }
+    struct allocation_block* block = find_allocation_block_for_allocation(ptr);
+    return !block || is_free(block) || block->requested_size == size;
+}
+#endif
+
+/**
+ * Frees an allocated block of memory of the given size, like `free_sized` but without tracing the call. Blocks too big
+ * to be slab objects skip looking for their slab. Builds that aren't hardened take the class of a slab object from
+ * `size`, so that freeing it into the thread cache reads no header at all.
+ *
+ * @param ptr The pointer returned by `*alloc`.
+ * @param size The size that was asked for when allocating `ptr`.
+ */
+void deallocate_sized(void* ptr, size_t size) {
+#ifdef __DEBUG__
+    if (!sized_free_matches(ptr, size)) {
+        fprintf(stderr, "Ignoring sized free of %p with size %zu, which it wasn't allocated with.\n", ptr, size);
+        return;
+    }
+#endif
+    if (size > SLAB_MAX_SIZE) {
+        deallocate_block(ptr);
+        return;
+    }
+#if MALLOC_HARDENED
+    deallocate(ptr);
+#else
+    char* region = __atomic_load_n(&slab_region, __ATOMIC_ACQUIRE);
+    if (!region || (char*) ptr < region || (char*) ptr >= region + SLAB_REGION_SIZE) {
+        deallocate_block(ptr);
+        return;
+    }
+    // An object shrunk by realloc sits in a bigger slot than `size` says, which only means it's cached for smaller
+    // allocations than it could hold.
+    size_t object_size = size ? (size + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1) : ALIGNMENT;
+    if (!thread_cache_put(ptr, object_size)) {
+        slab_free((struct slab*) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_SIZE - 1)), ptr);
+    }
+#endif
+}
+
+/**
+ * Checks whether a pointer is an arena object, whose header inside the heap is tagged ARENA_TAG.
+ *
+ * @param ptr The pointer to check, which isn't a slab object.
+ * @return TRUE if `ptr` is an arena object, or FALSE otherwise.
+ */
+int is_arena_object(void* ptr) {
+    struct allocation_block* block = data_block(ptr);
+    struct allocation_block* tail = __atomic_load_n(&allocation_tail, __ATOMIC_RELAXED);
+    return ptr && (uintptr_t) ptr % 8 == 0 && block >= __atomic_load_n(&allocation_head, __ATOMIC_RELAXED)
+            && tail && block < next_block(tail) && block_tag(block) == ARENA_TAG;
+}
+
+/**
+ * Resizes a previous allocation of memory to be of size `size`, like `realloc` but without tracing the call.
+ *
+ * @param ptr A pointer referencing the previous allocation.
+ * @param size The size to change to.
+ * @return A pointer to the start of the new/original block of memory, or NULL if no memory is left.
+ */
+void* reallocate(void* ptr, size_t size) {
+    struct slab* slab = find_slab_for_allocation(ptr);
+    if (slab) {
+        // Objects stay in their slab when shrinking, since the slot can't be split.
+        if (size > 0 && size <= slab->object_size) {
+            return ptr;
+        }
+        void* new_ptr = allocate(size);
+        if (new_ptr) {
+            memcpy(new_ptr, ptr, slab->object_size);
+        }
+        if (new_ptr || !size) {
+            deallocate(ptr);
+        }
+        return new_ptr;
+    }
+    // Arena objects don't record their size, so their data can't be moved.
+    if (is_arena_object(ptr)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t requested_size = size;
+    struct allocation_block* target_block = find_allocation_block_for_allocation(ptr);
+    if (size <= 0 || !target_block || is_free(target_block)) {
+        deallocate(ptr);
+        return allocate(size);
+    }
+    // The block is sampled afresh for its new size.
+    unsample_block(target_block);
+    int sampled = profile_should_sample(requested_size);
+    size = align(sampled ? size + sizeof(struct profile_sample*) : size);
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        if (block_tag(target_block) == MMAP_TAG) {
+            target_block = remap_block(target_block, size);
+        } else {
+            // Move the data out of the heap into its own mapping.
+            struct allocation_block* mapped_block = map_block(size);
+            if (mapped_block) {
+                memcpy(block_data(mapped_block), block_data(target_block),
+                       block_size(target_block) < size ? block_size(target_block) : size);
+                deallocate(ptr);
+            }
+            target_block = mapped_block;
+        }
+    } else if (block_tag(target_block) == MMAP_TAG) {
+        // Small enough to move back into the heap, which lets the mapping be returned to the OS.
+        pthread_mutex_lock(&heap_lock);
+        struct allocation_block* heap_block = allocate_block(size, NULL);
+        pthread_mutex_unlock(&heap_lock);
+        if (heap_block) {
+            memcpy(block_data(heap_block), block_data(target_block),
+                   block_size(target_block) < size ? block_size(target_block) : size);
+            unmap_block(target_block);
+        }
+        target_block = heap_block;
+    } else {
+        pthread_mutex_lock(&heap_lock);
+        target_block = resize_block(target_block, size);
+        // Shrinking the tail block leaves a free tail behind.
+        trim_if_needed();
+        pthread_mutex_unlock(&heap_lock);
+    }
+    if (!target_block) {
+        return NULL;
+    }
+#ifdef __DEBUG__
+    target_block->requested_size = requested_size;
+#endif
+    if (sampled) {
+        sample_block(target_block, requested_size);
+    }
+    return block_data(target_block);
+}
+
+/**
+ * Allocates some memory of size `size` whose start is a multiple of `alignment`, like `memalign` but without tracing
+ * the call.
+ *
+ * @param alignment The alignment of the block, rounded up to a power of two.
+ * @param size The size of the block to allocate.
+ * @return A pointer to the start of the block of memory, or NULL if no memory is left.
+ */
+void* allocate_aligned(size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT) {
+        return allocate(size);
+    }
+    // Like glibc, round alignments that aren't powers of two up to the next one.
+    if (alignment & (alignment - 1)) {
+        alignment = (size_t) 1 << (64 - __builtin_clzl(alignment));
+    }
+    if (size <= 0 || alignment > SIZE_MASK / 4 || size > SIZE_MASK / 4) {
+        return NULL;
+    }
+    int sampled = profile_should_sample(size);
+    size_t aligned_size = align(sampled ? size + sizeof(struct profile_sample*) : size);
+    struct allocation_block* block = NULL;
+    if (aligned_size < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&heap_lock);
+        block = allocate_aligned_block(alignment, aligned_size);
+        pthread_mutex_unlock(&heap_lock);
+    }
+    // Big blocks get a mapping of their own, like any other, as do blocks that the heap can't grow for.
+    if (!block) {
+        block = map_aligned_block(alignment, aligned_size);
+        if (!block) {
+            return NULL;
+        }
+    }
+#ifdef __DEBUG__
+    block->requested_size = size;
+#endif
+    if (sampled) {
+        sample_block(block, size);
+    }
+    return block_data(block);
+}
+
+/**
+ * Allocates `count` blocks of size `size` into `ptrs`, like `malloc_batch` but without tracing the calls.
+ *
+ * @param size The size of each block to allocate.
+ * @param count The number of blocks to allocate.
+ * @param ptrs The array to store the pointers to the start of each block into.
+ * @return The number of blocks allocated, less than `count` only if no memory is left.
+ */
+size_t allocate_batch(size_t size, size_t count, void** ptrs) {
+    if (size <= 0) {
+        return 0;
+    }
+    size_t allocated = 0;
+    if (size <= __atomic_load_n(&slab_max_size, __ATOMIC_RELAXED)) {
+        size_t object_size = (size + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+        while (allocated < count) {
+            int wanted = count - allocated < INT_MAX ? (int) (count - allocated) : INT_MAX;
+            int objects = slab_allocate(object_size, wanted, ptrs + allocated);
+            allocated += objects;
+            if (objects < wanted) {
+                // The slab region is exhausted, so fall back to the heap.
+                break;
+            }
+        }
+    }
+    size_t aligned_size = align(size);
+    size_t total_size;
+    if (allocated < count && aligned_size < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)
+            && !__builtin_mul_overflow(count - allocated, META_SIZE + aligned_size, &total_size)
+            && total_size <= SIZE_MASK) {
+        struct allocation_block** blocks = (struct allocation_block**) (ptrs + allocated);
+        pthread_mutex_lock(&heap_lock);
+        struct allocation_block* block = allocate_block(total_size - META_SIZE, NULL);
+        if (block) {
+            carve_blocks(block, aligned_size, count - allocated, blocks);
+        }
+        pthread_mutex_unlock(&heap_lock);
+        if (block) {
+            // The blocks were stored over the pointers that are returned.
+            for (size_t i = 0; i < count - allocated; i++) {
+#ifdef __DEBUG__
+                blocks[i]->requested_size = size;
+#endif
+                ptrs[allocated + i] = block_data(blocks[i]);
+            }
+            allocated = count;
+        }
+    }
+    // Whatever is left, such as blocks big enough for their own mappings, is allocated one at a time.
+    while (allocated < count && (ptrs[allocated] = allocate(size))) {
+        allocated++;
+    }
+    return allocated;
+}
+
+/**
+ * Compares two pointers by address, for sorting with qsort.
+ *
+ * @param a The first pointer.
+ * @param b The second pointer.
+ * @return A negative number, zero or a positive number if `a` is below, at or above `b`.
+ */
+int compare_pointers(const void* a, const void* b) {
+    uintptr_t first = (uintptr_t) *(void* const*) a;
+    uintptr_t second = (uintptr_t) *(void* const*) b;
+    return (first > second) - (first < second);
+}
+
+/**
+ * Frees `count` blocks of memory at once, like `free_batch` but without tracing the calls.
+ *
+ * @param ptrs The pointers returned by `*alloc`, which are left reordered.
+ * @param count The number of pointers.
+ */
+void deallocate_batch(void** ptrs, size_t count) {
+    // In address order, each heap block is merged into the one freed just before it if they are neighbours.
+    qsort(ptrs, count, sizeof(void*), compare_pointers);
+    size_t heap_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct allocation_block* block = find_allocation_block_for_allocation(ptrs[i]);
+        if (block && block_tag(block) == HEAP_TAG) {
+            if (!is_free(block)) {
+                unsample_block(block);
+            }
+            ptrs[heap_count++] = ptrs[i];
+        } else {
+            // Slab objects, mapped blocks and invalid pointers are handled one at a time.
+            deallocate(ptrs[i]);
+        }
+    }
+    pthread_mutex_lock(&heap_lock);
+    for (size_t i = 0; i < heap_count; i++) {
+        // A repeated pointer's block is either free already or was merged away, which clears its tag.
+        struct allocation_block* block = find_allocation_block_for_allocation(ptrs[i]);
+        if (block && !is_free(block)) {
+            set_block(block, block_size(block), TRUE);
+            merge_adjacent_free(block);
+        }
+    }
+    trim_if_needed();
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void* malloc(size_t size) {
+    void* ptr = allocate(size);
+    trace(TRACE_MALLOC, ptr, NULL, size);
+    return ptr;
+}
+
+void* calloc(size_t num_elements, size_t element_size) {
+    size_t size;
+    if (__builtin_mul_overflow(num_elements, element_size, &size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t dirty_size;
+    void* ptr = size > 0 ? allocate_with_dirty_size(size, &dirty_size) : NULL;
+    if (ptr) {
+        memset(ptr, 0, dirty_size < size ? dirty_size : size);
+    }
+    trace(TRACE_CALLOC, ptr, NULL, size);
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    void* new_ptr = reallocate(ptr, size);
+    trace(TRACE_REALLOC, new_ptr, ptr, size);
+    return new_ptr;
+}
+
+void free(void* ptr) {
+    // Traced first, so that the record comes before any record of another thread getting the same memory.
+    trace(TRACE_FREE, NULL, ptr, 0);
+    deallocate(ptr);
+}
+
+void free_sized(void* ptr, size_t size) {
+    trace(TRACE_FREE, NULL, ptr, 0);
+    deallocate_sized(ptr, size);
+}
+
+void free_aligned_sized(void* ptr, size_t alignment, size_t size) {
+    // Aligned blocks are freed like any other, so the alignment is only a check.
+#ifdef __DEBUG__
+    if (alignment && (uintptr_t) ptr % alignment) {
+        fprintf(stderr, "Ignoring sized free of %p with alignment %zu, which it wasn't allocated with.\n", ptr,
+                alignment);
+        return;
+    }
+#else
+    (void) alignment;
+#endif
+    free_sized(ptr, size);
+}
+
+size_t malloc_batch(size_t size, size_t count, void** ptrs) {
+    size_t allocated = allocate_batch(size, count, ptrs);
+    for (size_t i = 0; i < allocated; i++) {
+        trace(TRACE_MALLOC, ptrs[i], NULL, size);
+    }
+    return allocated;
+}
+
+void free_batch(void** ptrs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        trace(TRACE_FREE, NULL, ptrs[i], 0);
+    }
+    deallocate_batch(ptrs, count);
+}
+
+void* reallocarray(void* ptr, size_t num_elements, size_t element_size) {
+    size_t size;
+    if (__builtin_mul_overflow(num_elements, element_size, &size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    void* ptr = allocate_aligned(alignment, size);
+    trace(TRACE_MEMALIGN, ptr, (void*) alignment, size);
+    return ptr;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (!alignment || alignment % sizeof(void*) || alignment & (alignment - 1)) {
+        return EINVAL;
+    }
+    void* ptr = memalign(alignment, size);
+    if (!ptr && size > 0) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    if (!alignment || alignment & (alignment - 1)) {
+        return NULL;
+    }
+    return memalign(alignment, size);
+}
+
+void* valloc(size_t size) {
+    return memalign(getpagesize(), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t page_size = getpagesize();
+    // Like glibc, even an empty allocation gets a whole page.
+    size = size ? size : 1;
+    return memalign(page_size, (size + page_size - 1) / page_size * page_size);
+}
+
+/**
+ * Sets the tag of an allocated heap block, as it is handed to or taken back from an arena. Requires heap_lock.
+ *
+ * @param block The allocated heap block.
+ * @param tag The new tag.
+ */
+void set_block_tag(struct allocation_block* block, size_t tag) {
+    block->header = (block->header & ~(~(size_t) 0 << TAG_SHIFT)) | tag << TAG_SHIFT;
+}
+
+/**
+ * Gives an arena a new chunk with room for an object of `step` bytes, header included.
+ *
+ * @param arena The arena.
+ * @param step The size of the object that didn't fit, with its header, a multiple of ALIGNMENT.
+ * @return TRUE if the chunk was added, or FALSE if no memory is left.
+ */
+int arena_grow(struct arena* arena, size_t step) {
+    size_t size = ARENA_OBJECTS_OFFSET + step;
+    size = align(size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+    pthread_mutex_lock(&heap_lock);
+    struct allocation_block* block = size <= SIZE_MASK ? allocate_block(size, NULL) : NULL;
+    if (block) {
+        set_block_tag(block, ARENA_TAG);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    if (!block) {
+        return FALSE;
+    }
+#ifdef __DEBUG__
+    block->requested_size = block_size(block);
+#endif
+    struct arena_chunk* chunk = block_data(block);
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->next = (char*) chunk + ARENA_OBJECTS_OFFSET;
+    arena->end = (char*) chunk + block_size(block);
+    return TRUE;
+}
+
+/**
+ * Gives an arena's chunks back to the heap, all under one hold of heap_lock.
+ *
+ * @param chunk The first chunk to release, followed by the rest through their links.
+ */
+void arena_release_chunks(struct arena_chunk* chunk) {
+    if (!chunk) {
+        return;
+    }
+    pthread_mutex_lock(&heap_lock);
+    while (chunk) {
+        struct arena_chunk* next = chunk->next;
+        struct allocation_block* block = data_block(chunk);
+        set_block_tag(block, HEAP_TAG);
+        release_block(block);
+        chunk = next;
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+struct arena* arena_create() {
+    struct arena* arena = allocate(sizeof(struct arena));
+    if (arena) {
+        arena->chunks = NULL;
+        arena->next = arena->end = NULL;
+    }
+    return arena;
+}
+
+void* arena_malloc(struct arena* arena, size_t size) {
+    if (size <= 0 || size > SIZE_MASK) {
+        return NULL;
+    }
+    size_t step = (META_SIZE + size + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+    if ((size_t) (arena->end - arena->next) < step && !arena_grow(arena, step)) {
+        return NULL;
+    }
+    struct allocation_block* object = (struct allocation_block*) arena->next;
+    object->header = ARENA_TAG << TAG_SHIFT;
+#ifdef __DEBUG__
+    object->requested_size = size;
+#endif
+    arena->next += step;
+    return block_data(object);
+}
+
+void arena_reset(struct arena* arena) {
+    if (!arena->chunks) {
+        return;
+    }
+    // Keep the oldest chunk for the next objects, and give the rest back.
+    struct arena_chunk** oldest = &arena->chunks;
+    while ((*oldest)->next) {
+        oldest = &(*oldest)->next;
+    }
+    struct arena_chunk* kept = *oldest;
+    *oldest = NULL;
+    arena_release_chunks(arena->chunks);
+    arena->chunks = kept;
+    arena->next = (char*) kept + ARENA_OBJECTS_OFFSET;
+    arena->end = (char*) kept + block_size(data_block(kept));
+}
+
+void arena_destroy(struct arena* arena) {
+    if (arena) {
+        arena_release_chunks(arena->chunks);
+        deallocate(arena);
+    }
+}
+
+/**
+ * Runs the decay thread, which purges the heap every step of the decay time until M_DECAY_THREAD stops it.
+ *
+ * @param argument Unused.
+ * @return NULL.
+ */
+void* decay_thread_main(void* argument) {
+    (void) argument;
+    while (TRUE) {
+        size_t step = __atomic_load_n(&decay_time, __ATOMIC_RELAXED) / DECAY_STEPS;
+        step = step ? step : 1;
+        struct timespec delay = {step / 1000, step % 1000 * 1000000};
+        // A backlog of decayed blocks is purged a batch at a time, letting other threads take heap_lock in between.
+        if (!__atomic_load_n(&decay_backlog, __ATOMIC_RELAXED)) {
+            nanosleep(&delay, NULL);
+        }
+        if (!__atomic_load_n(&decay_thread_wanted, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&decay_thread_running, FALSE, __ATOMIC_SEQ_CST);
+            // The thread may have been asked for again by a call that still saw it running, which then left it be.
+            if (!__atomic_load_n(&decay_thread_wanted, __ATOMIC_SEQ_CST)
+                    || __atomic_exchange_n(&decay_thread_running, TRUE, __ATOMIC_SEQ_CST)) {
+                return NULL;
+            }
+        }
+        pthread_mutex_lock(&heap_lock);
+        if (decay_time) {
+            decay_purge(decay_clock());
+        }
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+/**
+ * Starts or stops the decay thread. A stopped thread exits when it next wakes up.
+ *
+ * @param wanted TRUE to start the thread, or FALSE to stop it.
+ * @return 1 on success, or 0 if the thread couldn't be started.
+ */
+int set_decay_thread(int wanted) {
+    __atomic_store_n(&decay_thread_wanted, wanted, __ATOMIC_SEQ_CST);
+    if (!wanted || __atomic_exchange_n(&decay_thread_running, TRUE, __ATOMIC_SEQ_CST)) {
+        return 1;
+    }
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    int failed = pthread_create(&thread, &attributes, decay_thread_main, NULL);
+    pthread_attr_destroy(&attributes);
+    if (failed) {
+        __atomic_store_n(&decay_thread_wanted, FALSE, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&decay_thread_running, FALSE, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+    return 1;
+}
+
+int mallopt(int parameter_number, int parameter_value) {
+    switch (parameter_number) {
+        case M_TCACHE_COUNT:
+            if (parameter_value < 0) {
+                return 0;
+            }
+            __atomic_store_n(&tcache_count, parameter_value, __ATOMIC_RELAXED);
+            return 1;
+        case M_TRIM_THRESHOLD:
+            if (parameter_value < 0) {
+                return 0;
+            }
+            pthread_mutex_lock(&heap_lock);
+            trim_threshold = parameter_value;
+            pthread_mutex_unlock(&heap_lock);
+            return 1;
+        case M_TOP_PAD:
+            if (parameter_value < 0) {
+                return 0;
+            }
+            pthread_mutex_lock(&heap_lock);
+            top_pad = parameter_value;
+            pthread_mutex_unlock(&heap_lock);
+            return 1;
+        case M_SLAB_MAX_SIZE:
+            if (parameter_value < 0 || parameter_value > SLAB_MAX_SIZE) {
+                return 0;
+            }
+            __atomic_store_n(&slab_max_size, parameter_value, __ATOMIC_RELAXED);
+            return 1;
+        case M_MMAP_THRESHOLD:
+            if (parameter_value <= 0) {
+                return 0;
+            }
+            __atomic_store_n(&mmap_threshold, parameter_value, __ATOMIC_RELAXED);
+            return 1;
+        case M_HEAP_RESERVE:
+            if (parameter_value < 0) {
+                return 0;
+            }
+            pthread_mutex_lock(&heap_lock);
+            // The heap can't move once it has started growing.
+            int started = heap_started;
+            if (!started) {
+                heap_reserve_size = (size_t) parameter_value * 1024 * 1024;
+            }
+            pthread_mutex_unlock(&heap_lock);
+            return !started;
+        case M_HEAP_GROWTH:
+            if (parameter_value < 0) {
+                return 0;
+            }
+            pthread_mutex_lock(&heap_lock);
+            heap_growth_min = parameter_value;
+            heap_growth = parameter_value;
+            pthread_mutex_unlock(&heap_lock);
+            return 1;
+        case M_PROFILE_RATE:
+            if (parameter_value < 0) {
+                return 0;
+            }
+            profile_set_rate(parameter_value);
+            return 1;
+        case M_HUGEPAGE_THRESHOLD:
+            if (parameter_value < 0) {
+                return 0;
+            }
+            pthread_mutex_lock(&heap_lock);
+            hugepage_threshold = parameter_value;
+            pthread_mutex_unlock(&heap_lock);
+            return 1;
+        case M_DECAY_TIME:
+            if (parameter_value < 0) {
+                return 0;
+            }
+            pthread_mutex_lock(&heap_lock);
+            __atomic_store_n(&decay_time, parameter_value, __ATOMIC_RELAXED);
+            decay_next = 0;
+            decay_ticks = 0;
+            pthread_mutex_unlock(&heap_lock);
+            return 1;
+        case M_DECAY_THREAD:
+            if (parameter_value != 0 && parameter_value != 1) {
+                return 0;
+            }
+            return set_decay_thread(parameter_value);
+        default:
+            return 0;
+    }
+}
+
+int malloc_trim(size_t pad) {
+    pthread_mutex_lock(&heap_lock);
+    // The heap is wanted small, so it starts growing by small steps again.
+    heap_growth = heap_growth_min;
+    size_t released = trim_tail(pad);
+    pthread_mutex_unlock(&heap_lock);
+    return released > 0;
+}
+
+size_t malloc_usable_size(void* ptr) {
+    struct slab* slab = find_slab_for_allocation(ptr);
+    if (slab) {
+        return slab->object_size;
+    }
+    struct allocation_block* block = find_allocation_block_for_allocation(ptr);
+    if (!block || is_free(block)) {
+        return 0;
+    }
+    return block->header & SAMPLED ? block_size(block) - sizeof(struct profile_sample*) : block_size(block);
+}
+
+void malloc_get_counters(struct malloc_counters* counters) {
+    pthread_mutex_lock(&heap_lock);
+    counters->heap_size = heap_size;
+    counters->heap_free = heap_free_size;
+    counters->heap_in_use = heap_size - heap_free_size;
+    counters->heap_free_blocks = heap_free_blocks;
+    counters->heap_max_size = heap_max_size;
+    counters->heap_releasable = allocation_tail && is_free(allocation_tail) ? block_size(allocation_tail) : 0;
+    counters->largest_free_block = largest_free_block_size();
+    counters->sbrk_calls = sbrk_calls;
+    counters->decay_purged = decay_purged;
+    pthread_mutex_unlock(&heap_lock);
+    counters->mapped_blocks = __atomic_load_n(&mapped_blocks, __ATOMIC_RELAXED);
+    counters->mapped_size = __atomic_load_n(&mapped_size, __ATOMIC_RELAXED);
+    counters->slab_size = 0;
+    counters->slab_in_use = 0;
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        pthread_mutex_lock(&slab_classes[i].lock);
+        counters->size_class_objects[i] = __atomic_load_n(&slab_classes[i].objects, __ATOMIC_RELAXED);
+        counters->slab_size += slab_classes[i].slabs * SLAB_SIZE;
+        counters->slab_in_use += counters->size_class_objects[i] * (i + 1) * ALIGNMENT;
+        pthread_mutex_unlock(&slab_classes[i].lock);
+    }
+}
+
+struct mallinfo2 mallinfo2() {
+    struct malloc_counters counters;
+    malloc_get_counters(&counters);
+    struct mallinfo2 info = {0};
+    info.arena = counters.heap_size + counters.slab_size;
+    info.ordblks = counters.heap_free_blocks;
+    info.hblks = counters.mapped_blocks;
+    info.hblkhd = counters.mapped_size;
+    info.usmblks = counters.heap_max_size;
+    info.fsmblks = counters.slab_size - counters.slab_in_use;
+    info.uordblks = counters.heap_in_use + counters.slab_in_use;
+    info.fordblks = counters.heap_free;
+    info.keepcost = counters.heap_releasable;
+    return info;
+}
+
+void malloc_stats() {
+    struct malloc_counters counters;
+    malloc_get_counters(&counters);
+    // stderr is unbuffered, so printing doesn't allocate.
+    fprintf(stderr, "heap bytes       = %10zu\n", counters.heap_size);
+    fprintf(stderr, "in use bytes     = %10zu\n", counters.heap_in_use);
+    fprintf(stderr, "free bytes       = %10zu (%zu blocks, largest %zu)\n", counters.heap_free,
+            counters.heap_free_blocks, counters.largest_free_block);
+    fprintf(stderr, "max heap bytes   = %10zu\n", counters.heap_max_size);
+    fprintf(stderr, "sbrk calls       = %10zu\n", counters.sbrk_calls);
+    fprintf(stderr, "purged bytes     = %10zu\n", counters.decay_purged);
+    fprintf(stderr, "mmap regions     = %10zu\n", counters.mapped_blocks);
+    fprintf(stderr, "mmap bytes       = %10zu\n", counters.mapped_size);
+    fprintf(stderr, "slab bytes       = %10zu\n", counters.slab_size);
+    fprintf(stderr, "slab in use      = %10zu\n", counters.slab_in_use);
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        if (counters.size_class_objects[i]) {
+            fprintf(stderr, "size class %5zu = %10zu objects\n", (i + 1) * ALIGNMENT, counters.size_class_objects[i]);
+        }
+    }
+}
+
+void malloc_iterate(void (*callback)(void* ptr, size_t size, size_t requested_size, int free, void* context),
+                    void* context) {
+    pthread_mutex_lock(&heap_lock);
+    for (struct allocation_block* block = allocation_head; block; block = next_allocation_block(block)) {
+#ifdef __DEBUG__
+        size_t requested_size = is_free(block) ? 0 : block->requested_size;
+#else
+        size_t requested_size = 0;
+#endif
+        callback(block_data(block), block_size(block), requested_size, is_free(block) ? TRUE : FALSE, context);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/**
+ * Writes out whatever a report has buffered.
+ *
+ * @param report The report.
+ */
+void info_flush(struct info_report* report) {
+    size_t written = 0;
+    while (written < report->used && !report->failed) {
+        ssize_t result = write(report->fd, report->buffer + written, report->used - written);
+        if (result > 0) {
+            written += result;
+        } else if (errno != EINTR) {
+            report->failed = TRUE;
+        }
+    }
+    report->used = 0;
+}
+
+/**
+ * Appends formatted text to a report, writing out the buffer whenever it fills. Each piece must fit in the buffer.
+ *
+ * @param report The report.
+ * @param format The printf format of the text.
+ */
+void info_printf(struct info_report* report, const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    va_list retry;
+    va_copy(retry, arguments);
+    size_t length = vsnprintf(report->buffer + report->used, sizeof(report->buffer) - report->used, format, arguments);
+    if (report->used + length >= sizeof(report->buffer)) {
+        info_flush(report);
+        length = vsnprintf(report->buffer, sizeof(report->buffer), format, retry);
+    }
+    report->used += length;
+    va_end(retry);
+    va_end(arguments);
+}
+
+/**
+ * Adds a heap block to a report, as a `malloc_iterate` callback.
+ *
+ * @param ptr The block's data.
+ * @param size The block's data size.
+ * @param requested_size The size that was asked for, or 0 if unknown.
+ * @param free Whether the block is free.
+ * @param context The report.
+ */
+void info_add_block(void* ptr, size_t size, size_t requested_size, int free, void* context) {
+    struct info_report* report = context;
+    // The heap lock is held, so the block is kept to be written later rather than written now. The heap may have grown
+    // since the scratch mapping was sized, in which case it's doubled.
+    if (!(report->options & MALLOC_INFO_SUMMARY) && !report->failed) {
+        if (report->block_count == report->block_capacity) {
+            size_t length = report->block_capacity * sizeof(struct info_block);
+            void* blocks = mremap(report->blocks, length, 2 * length, MREMAP_MAYMOVE);
+            if (blocks == MAP_FAILED) {
+                report->failed = TRUE;
+            } else {
+                report->blocks = blocks;
+                report->block_capacity *= 2;
+            }
+        }
+        if (!report->failed) {
+            report->blocks[report->block_count++] = (struct info_block) {ptr, size, requested_size, free};
+        }
+    }
+    if (!free) {
+        report->used_counts[info_bucket(size)]++;
+        report->used_sizes[info_bucket(size)] += size;
+        report->waste_counts[info_bucket(size - requested_size)] += requested_size != 0;
+        report->requested_size += requested_size;
+        return;
+    }
+    report->free_counts[info_bucket(size)]++;
+    report->free_sizes[info_bucket(size)] += size;
+    // Neighbouring free blocks are always merged, so each free block is a whole run of free space.
+    for (int i = 0; i < INFO_LONGEST_COUNT; i++) {
+        if (size > report->longest_sizes[i]) {
+            memmove(&report->longest[i + 1], &report->longest[i], (INFO_LONGEST_COUNT - i - 1) * sizeof(void*));
+            memmove(&report->longest_sizes[i + 1], &report->longest_sizes[i],
+                    (INFO_LONGEST_COUNT - i - 1) * sizeof(size_t));
+            report->longest[i] = ptr;
+            report->longest_sizes[i] = size;
+            break;
+        }
+    }
+}
+
+/**
+ * Writes a histogram of block sizes, one element per non-empty power of two bucket.
+ *
+ * @param report The report.
+ * @param type What the histogram counts.
+ * @param counts The number of blocks per bucket.
+ * @param sizes The total data size per bucket, or NULL to leave it out.
+ */
+void info_write_sizes(struct info_report* report, const char* type, size_t* counts, size_t* sizes) {
+    size_t count = 0, total = 0;
+    for (int i = 0; i < INFO_BUCKET_COUNT; i++) {
+        count += counts[i];
+        total += sizes ? sizes[i] : 0;
+    }
+    info_printf(report, "<sizes type=\"%s\" count=\"%zu\"", type, count);
+    info_printf(report, sizes ? " total=\"%zu\">\n" : ">\n", total);
+    for (int i = 0; i < INFO_BUCKET_COUNT; i++) {
+        if (counts[i]) {
+            size_t from = i ? (size_t) 1 << (i - 1) : 0;
+            size_t to = i ? (i == 64 ? SIZE_MAX : ((size_t) 1 << i) - 1) : 0;
+            info_printf(report, "<size from=\"%zu\" to=\"%zu\" count=\"%zu\"", from, to, counts[i]);
+            info_printf(report, sizes ? " total=\"%zu\"/>\n" : "/>\n", sizes ? sizes[i] : 0);
+        }
+    }
+    info_printf(report, "</sizes>\n");
+}
+
+int malloc_info(int options, FILE* stream) {
+    if (options & ~MALLOC_INFO_SUMMARY || !stream || fflush(stream) || fileno(stream) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct malloc_counters counters;
+    malloc_get_counters(&counters);
+    struct info_report report = {0};
+    report.fd = fileno(stream);
+    report.options = options;
+    if (!(options & MALLOC_INFO_SUMMARY)) {
+        // Room for as many blocks as the heap can hold, each taking at least a minimum sized block.
+        size_t page_size = getpagesize();
+        size_t length = ((counters.heap_size / (META_SIZE + align(1)) + 1) * sizeof(struct info_block) + page_size - 1)
+                / page_size * page_size;
+        report.blocks = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (report.blocks == MAP_FAILED) {
+            errno = ENOMEM;
+            return -1;
+        }
+        report.block_capacity = length / sizeof(struct info_block);
+    }
+    info_printf(&report, "<malloc version=\"1\">\n<heap size=\"%zu\" in-use=\"%zu\" free=\"%zu\">\n",
+                counters.heap_size, counters.heap_in_use, counters.heap_free);
+    malloc_iterate(info_add_block, &report);
+    for (size_t i = 0; i < report.block_count; i++) {
+        struct info_block* block = &report.blocks[i];
+        info_printf(&report, "<block address=\"%p\" size=\"%zu\" requested=\"%zu\" free=\"%d\"/>\n", block->ptr,
+                    block->size, block->requested_size, block->free);
+    }
+    if (report.blocks) {
+        munmap(report.blocks, report.block_capacity * sizeof(struct info_block));
+    }
+    info_printf(&report, "</heap>\n");
+    info_write_sizes(&report, "free", report.free_counts, report.free_sizes);
+    info_write_sizes(&report, "in-use", report.used_counts, report.used_sizes);
+#ifdef __DEBUG__
+    // Only instrumented builds know the size that was asked for, and so how much of each block is wasted.
+    info_printf(&report, "<requested total=\"%zu\"/>\n", report.requested_size);
+    info_write_sizes(&report, "waste", report.waste_counts, NULL);
+#endif
+    info_printf(&report, "<longest-free>\n");
+    for (int i = 0; i < INFO_LONGEST_COUNT && report.longest[i]; i++) {
+        info_printf(&report, "<block address=\"%p\" size=\"%zu\"/>\n", report.longest[i], report.longest_sizes[i]);
+    }
+    info_printf(&report, "</longest-free>\n<mmap count=\"%zu\" total=\"%zu\"/>\n", counters.mapped_blocks,
+                counters.mapped_size);
+    info_printf(&report, "<slabs total=\"%zu\" in-use=\"%zu\">\n", counters.slab_size, counters.slab_in_use);
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        if (counters.size_class_objects[i]) {
+            info_printf(&report, "<size class=\"%zu\" count=\"%zu\"/>\n", (i + 1) * ALIGNMENT,
+                        counters.size_class_objects[i]);
+        }
+    }
+    info_printf(&report, "</slabs>\n</malloc>\n");
+    info_flush(&report);
+    return report.failed ? -1 : 0;
+}
+
+/**
+ * Takes every lock before the process forks, so that the child doesn't inherit a lock held by a thread that doesn't
+ * exist in it. Locks are taken in the order used everywhere else: slab classes, then the slab region, then the heap.
+ */
+void prepare_fork() {
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        pthread_mutex_lock(&slab_classes[i].lock);
+    }
+    pthread_mutex_lock(&slab_region_lock);
+    pthread_mutex_lock(&heap_lock);
+}
+
+/**
+ * Releases the locks taken by `prepare_fork`, in both the parent and the child. Objects in the caches of the child's
+ * missing threads are never freed.
+ */
+void finish_fork() {
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_unlock(&slab_region_lock);
+    for (size_t i = SLAB_CLASS_COUNT; i > 0; i--) {
+        pthread_mutex_unlock(&slab_classes[i - 1].lock);
+    }
+}
+
+/**
+ * Releases the locks taken by `prepare_fork` in the child, which doesn't inherit the decay thread.
+ */
+void finish_fork_child() {
+    finish_fork();
+    decay_thread_wanted = FALSE;
+    decay_thread_running = FALSE;
+}
+
+/**
+ * Registers the fork handlers when the program or shared library is loaded, and applies the decay parameters from the
+ * MALLOC_DECAY_TIME and MALLOC_DECAY_THREAD environment variables. Nothing else needs initializing, so allocations made
+ * before this runs (e.g: by the dynamic loader) work as well.
+ */
+__attribute__((constructor)) void register_fork_handlers() {
+    pthread_atfork(prepare_fork, finish_fork, finish_fork_child);
+    char* decay = getenv("MALLOC_DECAY_TIME");
+    char* thread = getenv("MALLOC_DECAY_THREAD");
+    if (decay) {
+        mallopt(M_DECAY_TIME, atoi(decay));
+    }
+    if (thread) {
+        mallopt(M_DECAY_THREAD, atoi(thread));
     }
 }
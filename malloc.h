@@ -2,76 +2,432 @@
  * malloc.h
  *
  * Malloc library: malloc/calloc/realloc/free implementation.
+ * Safe to call from multiple threads at once.
  * Does not include these standard (ANSI/SVID/...) functions:
- *   memalign(size_t alignment, size_t n);
- *   valloc(size_t n);
  *   mallinfo();
- *   mallopt(int parameter_number, int parameter_value);
  *
  * Written by Darren Chan <darrennchan8@gmail.com>
  */
+#include <stddef.h>
+#include <stdio.h>
 #include <sys/types.h>
 
-// Typical uses of *alloc and free don't require knowing a lot of the calculations that we need to know, so only provide
-// debug information when necessary (e.g: for testing).
-#define __DEBUG__
-
 #ifndef ASSIGN3_ASSIGN3_H
 #define ASSIGN3_ASSIGN3_H
 
-#ifdef __DEBUG__
+// The shared library hides everything apart from the functions marked with this.
+#define MALLOC_EXPORT __attribute__((visibility("default")))
 
-struct allocation_block* allocation_head;
-struct allocation_block* allocation_tail;
+// For walking the heap in the tests and benchmarks; the shared library doesn't export these.
+extern struct allocation_block* allocation_head;
+extern struct allocation_block* allocation_tail;
 
 /** Documentation is available in malloc.c */
 struct allocation_block* find_allocation_block_for_allocation(void* ptr);
-
-#endif
+struct allocation_block* next_allocation_block(struct allocation_block* block);
+size_t allocation_block_size(struct allocation_block* block);
+int allocation_block_is_free(struct allocation_block* block);
 
 struct allocation_block {
+    // Instrumented builds, compiled with __DEBUG__, record the size that was asked for. Release builds leave it out, so
+    // that a block's only overhead is its header.
 #ifdef __DEBUG__
     size_t requested_size;
 #endif
-    size_t size;
-    struct allocation_block *next;
-    struct allocation_block *previous;
-    int free;
+    // The data size, a multiple of 8, with a tag for who owns the block in the top 16 bits (so that headers computed
+    // from arbitrary pointers can be validated cheaply) and the free and previous-in-use flags in the bottom 3 bits.
+    size_t header;
+    // Links within the free bin for this block's size class. These only exist while the block is free, since allocated
+    // blocks' data starts here. Free blocks also repeat their data size in their last 8 bytes.
+    struct allocation_block *next_free;
+    struct allocation_block *previous_free;
+    // Big free blocks are kept in a search tree instead of a bin, with these children as well. Their bin links hold
+    // their place in the list of blocks waiting to be purged instead.
+    struct allocation_block *children[2];
 };
 
+// The alignment of every allocation, a power of two from 16 (the default, which the x86-64 ABI expects) to 64. Set with
+// -DMALLOC_ALIGNMENT when building malloc.c, and the same when including this file.
+#ifndef MALLOC_ALIGNMENT
+#define MALLOC_ALIGNMENT 16
+#endif
+
+// The number of bytes before each block's data.
+#define ALLOCATION_META_SIZE offsetof(struct allocation_block, next_free)
+
 /**
- * Allocates some memory of size `size` and returns a pointer to the start of the block. The size allocated is
- * guaranteed to be aligned to 8 bytes.
+ * Allocates some memory of size `size` and returns a pointer to the start of the block. The block is guaranteed to be
+ * aligned to MALLOC_ALIGNMENT bytes, 16 by default.
  *
  * @param size The size of the block to allocate.
  * @return A pointer to the start of the block of memory.
  */
-void* malloc(size_t size);
+MALLOC_EXPORT void* malloc(size_t size);
 
 /**
  * Allocates some memory of size `num_elements * element_size` and returns a pointer to the start of the block. The size
- * allocated is guaranteed to be aligned to 8 bytes. Clears the memory to be all zeroes.
+ * allocated is guaranteed to be aligned to MALLOC_ALIGNMENT bytes. Clears the memory to be all zeroes, skipping memory
+ * that is fresh from the OS and so already zero.
  *
  * @param num_elements The number of units to allocate.
  * @param element_size The size of each unit.
- * @return A pointer to the start of the block of memory.
+ * @return A pointer to the start of the block of memory, or NULL with errno set to ENOMEM if the size overflows.
  */
-void* calloc(size_t num_elements, size_t element_size);
+MALLOC_EXPORT void* calloc(size_t num_elements, size_t element_size);
 
 /**
  * Resizes a previous allocation of memory to be of size `size`. Frees the previous allocation as necessary.
  *
  * @param ptr A pointer referencing the previous allocation, should be returned by `*alloc`.
- * @param size The size to change to. Aligned to 8 bytes.
+ * @param size The size to change to. Aligned to MALLOC_ALIGNMENT bytes.
  * @return A pointer to the start of the new/original block of memory.
  */
-void* realloc(void* ptr, size_t size);
+MALLOC_EXPORT void* realloc(void* ptr, size_t size);
+
+/**
+ * Resizes a previous allocation of memory to hold `num_elements` units of size `element_size`, like `realloc`.
+ *
+ * @param ptr A pointer referencing the previous allocation, should be returned by `*alloc`.
+ * @param num_elements The number of units to change to.
+ * @param element_size The size of each unit.
+ * @return A pointer to the start of the new/original block of memory, or NULL if the size overflows.
+ */
+MALLOC_EXPORT void* reallocarray(void* ptr, size_t num_elements, size_t element_size);
 
 /**
  * Frees a allocated block of memory previously allocated by `*alloc`.
  *
  * @param ptr The pointer returned by `*alloc`.
  */
-void free(void* ptr);
+MALLOC_EXPORT void free(void* ptr);
+
+/**
+ * Frees a block of memory previously allocated by `malloc`, `calloc` or `realloc` with size `size`, like C23's
+ * `free_sized`. Knowing the size lets big blocks skip the slab lookup, and builds with MALLOC_HARDENED set to 0 free
+ * small objects without reading any header. Debug builds check the size and ignore the free if it doesn't match.
+ *
+ * @param ptr The pointer returned by `*alloc`.
+ * @param size The size that was asked for when allocating `ptr`.
+ */
+MALLOC_EXPORT void free_sized(void* ptr, size_t size);
+
+/**
+ * Frees a block of memory previously allocated by `aligned_alloc` with alignment `alignment` and size `size`, like
+ * C23's `free_aligned_sized`.
+ *
+ * @param ptr The pointer returned by `aligned_alloc`.
+ * @param alignment The alignment that was asked for.
+ * @param size The size that was asked for.
+ */
+MALLOC_EXPORT void free_aligned_sized(void* ptr, size_t alignment, size_t size);
+
+/**
+ * Allocates `count` blocks of memory of size `size` at once, like calling `malloc` `count` times. Heap blocks are all
+ * carved out of one contiguous region found with a single lookup, and small objects come from slabs in one pass.
+ *
+ * @param size The size of each block to allocate.
+ * @param count The number of blocks to allocate.
+ * @param ptrs The array to store the pointers to the start of each block into.
+ * @return The number of blocks allocated, less than `count` only if no memory is left.
+ */
+MALLOC_EXPORT size_t malloc_batch(size_t size, size_t count, void** ptrs);
+
+/**
+ * Frees `count` blocks of memory at once, like calling `free` on each. The pointers are sorted by address so that
+ * neighbouring heap blocks are merged together in one pass under one lock. Invalid and repeated pointers are ignored.
+ *
+ * @param ptrs The pointers returned by `*alloc`, which are left reordered.
+ * @param count The number of pointers.
+ */
+MALLOC_EXPORT void free_batch(void** ptrs, size_t count);
+
+/**
+ * Allocates some memory of size `size` whose start is a multiple of `alignment`. The padding needed to align the block
+ * is given back to the heap rather than wasted, and blocks of at least M_MMAP_THRESHOLD bytes get an aligned mapping of
+ * their own.
+ *
+ * @param alignment The alignment of the block, rounded up to a power of two.
+ * @param size The size of the block to allocate.
+ * @return A pointer to the start of the block of memory, or NULL if no memory is left.
+ */
+MALLOC_EXPORT void* memalign(size_t alignment, size_t size);
+
+/**
+ * Allocates some memory of size `size` whose start is a multiple of `alignment` and stores it to `memptr`.
+ *
+ * @param memptr Where to store the pointer to the start of the block of memory.
+ * @param alignment The alignment of the block, a power of two multiple of `sizeof(void*)`.
+ * @param size The size of the block to allocate.
+ * @return 0 on success, EINVAL if `alignment` is invalid, or ENOMEM if no memory is left.
+ */
+MALLOC_EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size);
+
+/**
+ * Allocates some memory of size `size` whose start is a multiple of `alignment`.
+ *
+ * @param alignment The alignment of the block, a power of two.
+ * @param size The size of the block to allocate.
+ * @return A pointer to the start of the block of memory, or NULL if `alignment` is invalid or no memory is left.
+ */
+MALLOC_EXPORT void* aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * Allocates some memory of size `size` starting on a page boundary.
+ *
+ * @param size The size of the block to allocate.
+ * @return A pointer to the start of the block of memory, or NULL if no memory is left.
+ */
+MALLOC_EXPORT void* valloc(size_t size);
+
+/**
+ * Allocates some whole pages of memory to fit `size` bytes, starting on a page boundary.
+ *
+ * @param size The size of the block to allocate, rounded up to a multiple of the page size.
+ * @return A pointer to the start of the block of memory, or NULL if no memory is left.
+ */
+MALLOC_EXPORT void* pvalloc(size_t size);
+
+/**
+ * An arena of objects that are all freed together. Objects are bumped out of chunks taken from the heap, and `free`
+ * ignores them. They don't record their size, so `realloc` fails on them with EINVAL. An arena must only be used by one
+ * thread at a time.
+ */
+struct arena;
+
+/**
+ * Creates an empty arena.
+ *
+ * @return The arena, or NULL if no memory is left.
+ */
+MALLOC_EXPORT struct arena* arena_create();
+
+/**
+ * Allocates some memory of size `size` from an arena. The block is guaranteed to be aligned to MALLOC_ALIGNMENT bytes,
+ * and lives until the arena is reset or destroyed.
+ *
+ * @param arena The arena to allocate from.
+ * @param size The size of the block to allocate.
+ * @return A pointer to the start of the block of memory, or NULL if no memory is left.
+ */
+MALLOC_EXPORT void* arena_malloc(struct arena* arena, size_t size);
+
+/**
+ * Frees every object in an arena at once, in time proportional to the number of chunks. The oldest chunk is kept for
+ * the next objects, and the rest are given back to the heap.
+ *
+ * @param arena The arena to reset.
+ */
+MALLOC_EXPORT void arena_reset(struct arena* arena);
+
+/**
+ * Frees every object in an arena and the arena itself.
+ *
+ * @param arena The arena to destroy.
+ */
+MALLOC_EXPORT void arena_destroy(struct arena* arena);
+
+/**
+ * Parameters for `mallopt`.
+ *   M_TRIM_THRESHOLD: The size in bytes that the free block at the end of the heap must exceed before it is given back
+ *     to the OS. 128 KiB by default.
+ *   M_TOP_PAD: The number of free bytes to keep at the end of the heap when giving it back to the OS. 0 by default.
+ *   M_MMAP_THRESHOLD: The size in bytes from which allocations get their own mapping, which is returned to the OS as
+ *     soon as they are freed. 128 KiB by default.
+ *   M_TCACHE_COUNT: The number of blocks of each small size that every thread caches, 0 to disable caching.
+ *   M_SLAB_MAX_SIZE: The size in bytes up to which allocations are packed into slabs without headers, at most 256 (the
+ *     default). 0 disables slabs.
+ *   M_HEAP_RESERVE: The size in MiB of a region reserved with mmap for the heap to grow inside of, instead of growing
+ *     with sbrk. The region is aligned to a 2 MiB huge page so that it can be backed by transparent huge pages, and is
+ *     only committed 2 MiB at a time as the heap reaches it. Once the region is full, allocations that don't fit in the
+ *     heap get mappings of their own. Only takes effect before the heap is first used. 0 (the default) uses sbrk. Also
+ *     read from the MALLOC_HEAP_RESERVE environment variable.
+ *   M_HUGEPAGE_THRESHOLD: The size in bytes the heap must reach before its region is advised to use transparent huge
+ *     pages. Huge pages cut TLB misses on big heaps, but are backed 2 MiB at a time, so raising this keeps small heaps'
+ *     RSS down. 0 by default. Also read from the MALLOC_HUGEPAGE_THRESHOLD environment variable.
+ *   M_PROFILE_RATE: The mean number of bytes allocated between the allocations that the heap profiler samples (see
+ *     `malloc_profile_dump`). 0 (the default) turns profiling off. Also read from the MALLOC_PROFILE_RATE environment
+ *     variable.
+ *   M_HEAP_GROWTH: The smallest step in bytes that the heap grows by. The step doubles each time the heap grows, up to
+ *     4 MiB, and allocations are carved out of the free tail left behind, so that the heap grows a logarithmic number
+ *     of times. Trimming keeps the next step's worth of free tail. 64 KiB by default; 0 grows the heap by exactly what
+ *     each allocation needs.
+ *   M_DECAY_TIME: The number of milliseconds a big free block in the heap may stay dirty before its pages are given
+ *     back to the OS with madvise. The purged block reads as zero afterwards, so calloc doesn't clear it again. Purging
+ *     is done by the calls that free memory, or by the decay thread. 10000 by default; 0 never purges. Also read from
+ *     the MALLOC_DECAY_TIME environment variable.
+ *   M_DECAY_THREAD: 1 starts a background thread that purges the heap as its blocks decay, so that memory is given back
+ *     even while the program makes no calls into the allocator. 0 (the default) stops it. Also read from the
+ *     MALLOC_DECAY_THREAD environment variable. Children created with fork don't inherit the thread.
+ */
+#define M_TRIM_THRESHOLD -1
+#define M_TOP_PAD -2
+#define M_MMAP_THRESHOLD -3
+#define M_TCACHE_COUNT -100
+#define M_SLAB_MAX_SIZE -101
+#define M_HEAP_RESERVE -102
+#define M_HUGEPAGE_THRESHOLD -103
+#define M_PROFILE_RATE -104
+#define M_HEAP_GROWTH -105
+#define M_DECAY_TIME -106
+#define M_DECAY_THREAD -107
+
+/**
+ * Adjusts a tunable parameter of the allocator.
+ *
+ * @param parameter_number One of the parameters documented above.
+ * @param parameter_value The value to set the parameter to.
+ * @return 1 if the parameter was set, or 0 if the parameter or value is invalid.
+ */
+MALLOC_EXPORT int mallopt(int parameter_number, int parameter_value);
+
+/**
+ * Gives the free memory at the end of the heap back to the OS, keeping `pad` bytes of it for future allocations.
+ *
+ * @param pad The number of free bytes to keep at the end of the heap.
+ * @return 1 if any memory was given back, or 0 otherwise.
+ */
+MALLOC_EXPORT int malloc_trim(size_t pad);
+
+/**
+ * Gets the number of bytes that can be used at `ptr`, which may be more than was asked for.
+ *
+ * @param ptr The pointer returned by `*alloc`.
+ * @return The usable size of the allocation, or 0 if `ptr` isn't a live allocation.
+ */
+MALLOC_EXPORT size_t malloc_usable_size(void* ptr);
+
+// The number of slab size classes, one per multiple of MALLOC_ALIGNMENT bytes up to 256.
+#define MALLOC_SIZE_CLASS_COUNT (256 / MALLOC_ALIGNMENT)
+
+/**
+ * Running totals kept by the allocator, all in bytes unless stated otherwise. Objects sitting in thread caches count as
+ * in use.
+ */
+struct malloc_counters {
+    // The heap obtained with sbrk, split into allocated blocks (including their headers) and free blocks.
+    size_t heap_size;
+    size_t heap_in_use;
+    size_t heap_free;
+    // The number of free heap blocks, and the data size of the largest one.
+    size_t heap_free_blocks;
+    size_t largest_free_block;
+    // The largest the heap has been, and how much of the current heap `malloc_trim` could give back.
+    size_t heap_max_size;
+    size_t heap_releasable;
+    // The number of times the program break was moved.
+    size_t sbrk_calls;
+    // Large allocations with their own mappings.
+    size_t mapped_blocks;
+    size_t mapped_size;
+    // Slab pages owned by the size classes, and the objects handed out from them.
+    size_t slab_size;
+    size_t slab_in_use;
+    // The bytes of free heap blocks given back to the OS by decay purging, in total.
+    size_t decay_purged;
+    // The number of objects of each slab size class (MALLOC_ALIGNMENT * (i + 1) bytes) handed out.
+    size_t size_class_objects[MALLOC_SIZE_CLASS_COUNT];
+};
+
+/**
+ * Reads the allocator's running totals. Cheap enough to poll often: nothing is walked apart from the largest bin of
+ * free blocks.
+ *
+ * @param counters Where to store the totals.
+ */
+MALLOC_EXPORT void malloc_get_counters(struct malloc_counters* counters);
+
+/**
+ * The memory usage summary returned by `mallinfo2`, laid out like glibc's.
+ *   arena: Bytes obtained for the heap and slabs.
+ *   ordblks: The number of free heap blocks.
+ *   smblks: Unused, always 0.
+ *   hblks, hblkhd: The number of large allocations with their own mappings, and their total size.
+ *   usmblks: The largest the heap has been.
+ *   fsmblks: Bytes in free slab slots.
+ *   uordblks: Bytes in use by heap blocks (including headers) and slab objects.
+ *   fordblks: Bytes in free heap blocks.
+ *   keepcost: Bytes at the end of the heap that `malloc_trim` could give back.
+ */
+struct mallinfo2 {
+    size_t arena;
+    size_t ordblks;
+    size_t smblks;
+    size_t hblks;
+    size_t hblkhd;
+    size_t usmblks;
+    size_t fsmblks;
+    size_t uordblks;
+    size_t fordblks;
+    size_t keepcost;
+};
+
+/**
+ * Summarizes the allocator's memory usage.
+ *
+ * @return The summary documented above.
+ */
+MALLOC_EXPORT struct mallinfo2 mallinfo2();
+
+/**
+ * Prints the allocator's running totals and the number of objects in each slab size class to stderr.
+ */
+MALLOC_EXPORT void malloc_stats();
+
+/**
+ * Walks the heap in address order in one pass, calling `callback` for every block while holding the heap lock. The walk
+ * doesn't allocate, and `callback` mustn't call into the allocator. Every other thread's heap allocations wait for the
+ * walk, so `callback` shouldn't block either, for example by writing to a pipe or socket. Objects in slabs and large
+ * allocations with their own mappings aren't heap blocks; blocks in thread caches are reported as in use.
+ *
+ * @param callback Called with each block's data, its data size, the size that was asked for (0 if free, or in release
+ *     builds, which don't record it), whether it's free, and `context`.
+ * @param context Passed to `callback`.
+ */
+MALLOC_EXPORT void malloc_iterate(void (*callback)(void* ptr, size_t size, size_t requested_size, int free,
+                                                   void* context), void* context);
+
+// Leaves the per-block layout out of `malloc_info`'s report, for big heaps.
+#define MALLOC_INFO_SUMMARY 1
+
+/**
+ * Writes a fragmentation report of the heap as XML, like glibc's `malloc_info`, walking the heap once with
+ * `malloc_iterate`. The report has the address-ordered layout of the heap blocks (<heap>), histograms of free and in
+ * use block sizes by powers of two (<sizes>), how much of each block is wasted past the size that was asked for in
+ * instrumented builds (<requested> and <sizes type="waste">), the biggest runs of free space (<longest-free>), and the
+ * mapped and slab totals. The report is written to the stream's file directly, without allocating. The blocks are
+ * gathered into a scratch mapping during the walk and only written once the heap lock has been released.
+ *
+ * @param options 0, or MALLOC_INFO_SUMMARY.
+ * @param stream The stream to write to, which must have a file.
+ * @return 0 if the report was written, or -1 with errno set if the options or stream are invalid or writing failed.
+ */
+MALLOC_EXPORT int malloc_info(int options, FILE* stream);
+
+/**
+ * Starts recording every `malloc`, `calloc`, `realloc`, `free` and `memalign` call made by the process to a trace file,
+ * in the format described in trace.h. Setting the environment variable MALLOC_TRACE_FILE does the same when the
+ * program starts. Only one trace can be recorded per process.
+ *
+ * @param path The file to write the trace to.
+ * @return 1 if recording started, or 0 if the file couldn't be created or a trace was already recorded.
+ */
+MALLOC_EXPORT int malloc_trace_start(const char* path);
+
+/**
+ * Stops recording the trace started by `malloc_trace_start`, and cuts the trace file down to the records written.
+ */
+MALLOC_EXPORT void malloc_trace_stop();
+
+/**
+ * Writes the allocations sampled by the heap profiler that are still live to a file, as a heap profile that pprof reads
+ * (`pprof program file`). Each sample records the stack that allocated it. `malloc`, `calloc` and `realloc` are sampled
+ * while M_PROFILE_RATE is set; aligned and batch allocations aren't. Setting the environment variable
+ * MALLOC_PROFILE_FILE to a prefix also writes a profile to "<prefix>.<pid>.<count>.heap" whenever the process gets
+ * SIGUSR2.
+ *
+ * @param path The file to write the profile to.
+ * @return 1 if the profile was written, or 0 if the file couldn't be created.
+ */
+MALLOC_EXPORT int malloc_profile_dump(const char* path);
 
 #endif //ASSIGN3_ASSIGN3_H
@@ -0,0 +1,40 @@
+/*
+ * memleak.c
+ *
+ * Memory leak calculations: walks the heap to measure internal and external fragmentation. Shared by the tests and the
+ * benchmarks.
+ */
+#include "malloc.h"
+#include "memleak.h"
+
+/**
+ * Adds `block`'s memory leak to `internal` and `external`.
+ *
+ * @param block The allocation block to calculate the memory leak for.
+ * @param internal A pointer to a size_t, for recording the internal memory leak.
+ * @param external A pointer to a size_t, for recording the external memory leak.
+ */
+void record_memory_leak_for_block(struct allocation_block* block, size_t* internal, size_t* external) {
+    size_t size = allocation_block_size(block);
+    *external += allocation_block_is_free(block) ? size : 0;
+#ifdef __DEBUG__
+    *internal += allocation_block_is_free(block) ? 0 : size - block->requested_size;
+#else
+    // Only instrumented builds know the size that was asked for.
+    (void) internal;
+#endif
+}
+
+/**
+ * Gets the total memory leak and records to `internal` and `external`.
+ *
+ * @param internal A pointer to a size_t, for recording the internal memory leak.
+ * @param external A pointer to a size_t, for recording the external memory leak.
+ */
+void get_total_memory_leak(size_t* internal, size_t* external) {
+    *internal = 0;
+    *external = 0;
+    for (struct allocation_block* block = allocation_head; block; block = next_allocation_block(block)) {
+        record_memory_leak_for_block(block, internal, external);
+    }
+}
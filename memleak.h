@@ -0,0 +1,15 @@
+/*
+ * memleak.h
+ *
+ * Memory leak calculations for the heap managed by malloc.c. Needs the debug information from malloc.h.
+ */
+#include "malloc.h"
+
+#ifndef ASSIGN3_MEMLEAK_H
+#define ASSIGN3_MEMLEAK_H
+
+/** Documentation is available in memleak.c */
+void record_memory_leak_for_block(struct allocation_block* block, size_t* internal, size_t* external);
+void get_total_memory_leak(size_t* internal, size_t* external);
+
+#endif //ASSIGN3_MEMLEAK_H
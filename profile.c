@@ -0,0 +1,417 @@
+/*
+ * profile.c
+ *
+ * Heap profiler: samples about one allocation per `profile_rate` bytes allocated, records the stack that made it, and
+ * writes the samples that are still live as a heap profile in the text format pprof reads. Samples are kept in memory
+ * mapped here rather than allocated, so that profiling never shows up in its own profiles. Profiling starts when the
+ * program is loaded if MALLOC_PROFILE_RATE is set, or on `mallopt(M_PROFILE_RATE, ...)`.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "malloc.h"
+#include "profile.h"
+
+#define TRUE 1
+#define FALSE 0
+// Samples are mapped this many bytes at a time.
+#define PROFILE_POOL_SIZE (64 * 1024)
+#define PROFILE_PATH_MAX 4096
+// Enough for a 64-bit number in any base from 2 up.
+#define PROFILE_NUMBER_MAX 64
+
+/**
+ * Buffers a profile on its way to a file, since a profile is written a few bytes at a time.
+ */
+struct profile_writer {
+    int fd;
+    size_t used;
+    char buffer[4096];
+};
+
+size_t profile_rate = 0;
+// The rate the live samples were taken at, which profiles still report once profiling is turned off.
+size_t profile_last_rate = 0;
+// A spin lock rather than a mutex, so that the signal handler can try to take it. Held while the samples change.
+int profile_locked = FALSE;
+// Set by a signal that asked for a profile while the lock was taken, for whoever held it to write.
+int profile_dump_pending = FALSE;
+struct profile_sample* profile_live = NULL;
+struct profile_sample* profile_unused = NULL;
+size_t profile_live_count = 0;
+size_t profile_live_bytes = 0;
+// Profiles asked for by a signal go to "<prefix>.<pid>.<count>.heap".
+char profile_prefix[PROFILE_PATH_MAX];
+size_t profile_dump_count = 0;
+__thread size_t profile_bytes_left __attribute__((tls_model("initial-exec")));
+__thread uint64_t profile_seed __attribute__((tls_model("initial-exec")));
+// Set while the thread is capturing a stack, since that may allocate.
+__thread int profile_busy __attribute__((tls_model("initial-exec")));
+
+/**
+ * Picks the number of bytes until the calling thread's next sample. The gaps are exponentially distributed with mean
+ * `profile_rate`, so that every byte is equally likely to be sampled however the allocations are sized, which is what
+ * pprof assumes when it scales the samples back up.
+ *
+ * @return The number of bytes, at least 1.
+ */
+size_t profile_interval() {
+    if (!profile_seed) {
+        profile_seed = (uintptr_t) &profile_seed * 0x9E3779B97F4A7C15ULL | 1;
+    }
+    profile_seed ^= profile_seed << 13;
+    profile_seed ^= profile_seed >> 7;
+    profile_seed ^= profile_seed << 17;
+    // -ln(u) for u in (0, 1]. log2 of the mantissa is approximated by a polynomial, which is plenty for sampling.
+    double u = (double) ((profile_seed >> 11) + 1) * 0x1p-53;
+    uint64_t bits;
+    memcpy(&bits, &u, sizeof(bits));
+    int exponent = (int) ((bits >> 52) & 0x7FF) - 1023;
+    bits = (bits & ((1ULL << 52) - 1)) | 1023ULL << 52;
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    double log2_u = exponent + (-1.7417939 + (2.8212026 + (-1.4699568 + (0.44717955 - 0.056570851 * m) * m) * m) * m);
+    double interval = -log2_u * 0.6931471805599453 * (double) __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+    return interval < 1 ? 1 : (size_t) interval;
+}
+
+/**
+ * Sets the mean number of bytes allocated between samples, 0 to stop sampling.
+ *
+ * @param rate The number of bytes.
+ */
+void profile_set_rate(size_t rate) {
+    if (rate) {
+        // The first stack capture loads the unwinder, which allocates, so get it out of the way now.
+        void* frame;
+        profile_busy = TRUE;
+        backtrace(&frame, 1);
+        profile_busy = FALSE;
+        __atomic_store_n(&profile_last_rate, rate, __ATOMIC_RELAXED);
+    }
+    profile_bytes_left = 0;
+    __atomic_store_n(&profile_rate, rate, __ATOMIC_RELAXED);
+}
+
+/**
+ * Counts an allocation of `size` bytes towards the calling thread's next sample. Only called while profiling is on.
+ *
+ * @param size The size of the allocation.
+ * @return TRUE if the allocation should be sampled, or FALSE otherwise.
+ */
+int profile_count(size_t size) {
+    if (profile_busy) {
+        return FALSE;
+    }
+    if (!profile_bytes_left) {
+        profile_bytes_left = profile_interval();
+    }
+    if (size < profile_bytes_left) {
+        profile_bytes_left -= size;
+        return FALSE;
+    }
+    profile_bytes_left = profile_interval();
+    return TRUE;
+}
+
+/**
+ * Formats a number into `text`, without a terminator.
+ *
+ * @param text The buffer to format into, of at least PROFILE_NUMBER_MAX bytes.
+ * @param value The number.
+ * @param base The base to format in, 10 or 16.
+ * @return The number of characters written.
+ */
+size_t profile_format_number(char* text, uint64_t value, int base) {
+    char digits[PROFILE_NUMBER_MAX];
+    size_t count = 0;
+    do {
+        digits[count++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value);
+    for (size_t i = 0; i < count; i++) {
+        text[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+/**
+ * Writes out whatever a profile writer has buffered.
+ *
+ * @param writer The profile writer.
+ */
+void profile_flush(struct profile_writer* writer) {
+    size_t written = 0;
+    while (written < writer->used) {
+        ssize_t result = write(writer->fd, writer->buffer + written, writer->used - written);
+        if (result <= 0 && errno != EINTR) {
+            break;
+        }
+        written += result > 0 ? result : 0;
+    }
+    writer->used = 0;
+}
+
+/**
+ * Appends text to a profile writer's buffer, writing out the buffer whenever it fills.
+ *
+ * @param writer The profile writer.
+ * @param text The text.
+ * @param length The length of the text.
+ */
+void profile_write(struct profile_writer* writer, const char* text, size_t length) {
+    while (length) {
+        if (writer->used == sizeof(writer->buffer)) {
+            profile_flush(writer);
+        }
+        size_t chunk = sizeof(writer->buffer) - writer->used < length ? sizeof(writer->buffer) - writer->used : length;
+        memcpy(writer->buffer + writer->used, text, chunk);
+        writer->used += chunk;
+        text += chunk;
+        length -= chunk;
+    }
+}
+
+/**
+ * Appends a null-terminated string to a profile writer's buffer.
+ *
+ * @param writer The profile writer.
+ * @param text The string, which is written without its terminator.
+ */
+void profile_write_string(struct profile_writer* writer, const char* text) {
+    profile_write(writer, text, strlen(text));
+}
+
+/**
+ * Appends a number to a profile writer's buffer, formatted by profile_format_number.
+ *
+ * @param writer The profile writer.
+ * @param value The number.
+ * @param base The base to format in, 10 or 16.
+ */
+void profile_write_number(struct profile_writer* writer, uint64_t value, int base) {
+    char text[PROFILE_NUMBER_MAX];
+    profile_write(writer, text, profile_format_number(text, value, base));
+}
+
+/**
+ * Writes the live samples to a file as a heap profile in pprof's legacy text format: a header naming the sampling rate,
+ * a line per sample giving its size and stack, and the process's mappings so that the stacks can be symbolized. Only
+ * makes async-signal-safe calls. Requires profile_locked.
+ *
+ * @param fd The file to write to.
+ */
+void profile_write_all(int fd) {
+    struct profile_writer writer;
+    writer.fd = fd;
+    writer.used = 0;
+    profile_write_string(&writer, "heap profile: ");
+    profile_write_number(&writer, profile_live_count, 10);
+    profile_write_string(&writer, ": ");
+    profile_write_number(&writer, profile_live_bytes, 10);
+    profile_write_string(&writer, " [");
+    profile_write_number(&writer, profile_live_count, 10);
+    profile_write_string(&writer, ": ");
+    profile_write_number(&writer, profile_live_bytes, 10);
+    profile_write_string(&writer, "] @ heap_v2/");
+    profile_write_number(&writer, __atomic_load_n(&profile_last_rate, __ATOMIC_RELAXED), 10);
+    profile_write_string(&writer, "\n");
+    for (struct profile_sample* sample = profile_live; sample; sample = sample->next) {
+        profile_write_string(&writer, "1: ");
+        profile_write_number(&writer, sample->requested_size, 10);
+        profile_write_string(&writer, " [1: ");
+        profile_write_number(&writer, sample->requested_size, 10);
+        profile_write_string(&writer, "] @");
+        for (int i = 0; i < sample->depth; i++) {
+            profile_write_string(&writer, " 0x");
+            profile_write_number(&writer, (uintptr_t) sample->stack[i], 16);
+        }
+        profile_write_string(&writer, "\n");
+    }
+    profile_write_string(&writer, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        char buffer[4096];
+        ssize_t length;
+        while ((length = read(maps, buffer, sizeof(buffer))) > 0) {
+            profile_write(&writer, buffer, length);
+        }
+        close(maps);
+    }
+    profile_flush(&writer);
+}
+
+/**
+ * Writes a profile to the next "<prefix>.<pid>.<count>.heap" file. Requires profile_locked.
+ */
+void profile_write_numbered() {
+    char path[PROFILE_PATH_MAX + 2 * PROFILE_NUMBER_MAX + 8];
+    size_t length = strlen(profile_prefix);
+    memcpy(path, profile_prefix, length);
+    path[length++] = '.';
+    length += profile_format_number(path + length, getpid(), 10);
+    path[length++] = '.';
+    length += profile_format_number(path + length, ++profile_dump_count, 10);
+    memcpy(path + length, ".heap", sizeof(".heap"));
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        profile_write_all(fd);
+        close(fd);
+    }
+}
+
+/**
+ * Takes profile_locked, which is only ever held briefly apart from while a profile is written.
+ */
+void profile_lock() {
+    while (__atomic_exchange_n(&profile_locked, TRUE, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+/**
+ * Releases profile_locked, then writes any profiles that signals asked for while it was held.
+ */
+void profile_unlock() {
+    __atomic_store_n(&profile_locked, FALSE, __ATOMIC_RELEASE);
+    // If the lock is taken again in the meantime, its new holder writes the profile instead.
+    while (__atomic_load_n(&profile_dump_pending, __ATOMIC_ACQUIRE)
+            && !__atomic_exchange_n(&profile_locked, TRUE, __ATOMIC_ACQUIRE)) {
+        if (__atomic_exchange_n(&profile_dump_pending, FALSE, __ATOMIC_ACQ_REL)) {
+            profile_write_numbered();
+        }
+        __atomic_store_n(&profile_locked, FALSE, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Writes a profile when the process gets SIGUSR2. The lock can't be waited for here, since the interrupted thread may
+ * hold it, so a profile that can't be written now is left to the lock's holder.
+ *
+ * @param signal The signal number.
+ */
+void profile_signal_handler(int signal) {
+    (void) signal;
+    int saved_errno = errno;
+    __atomic_store_n(&profile_dump_pending, TRUE, __ATOMIC_RELEASE);
+    if (!__atomic_exchange_n(&profile_locked, TRUE, __ATOMIC_ACQUIRE)) {
+        profile_unlock();
+    }
+    errno = saved_errno;
+}
+
+/**
+ * Records a sample of an allocation made by the calling thread's current stack.
+ *
+ * @param size The size that was asked for.
+ * @return The sample, or NULL if no memory was left to record it in.
+ */
+struct profile_sample* profile_sample_create(size_t size) {
+    void* stack[PROFILE_MAX_DEPTH + 1];
+    profile_busy = TRUE;
+    int depth = backtrace(stack, PROFILE_MAX_DEPTH + 1);
+    profile_busy = FALSE;
+    profile_lock();
+    if (!profile_unused) {
+        struct profile_sample* pool = mmap(NULL, PROFILE_POOL_SIZE, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool == MAP_FAILED) {
+            profile_unlock();
+            return NULL;
+        }
+        for (size_t i = 0; i < PROFILE_POOL_SIZE / sizeof(struct profile_sample); i++) {
+            pool[i].next = profile_unused;
+            profile_unused = &pool[i];
+        }
+    }
+    struct profile_sample* sample = profile_unused;
+    profile_unused = sample->next;
+    sample->requested_size = size;
+    // The innermost frame is this function.
+    sample->depth = depth > 1 ? depth - 1 : 0;
+    memcpy(sample->stack, stack + 1, sample->depth * sizeof(void*));
+    sample->previous = NULL;
+    sample->next = profile_live;
+    if (profile_live) {
+        profile_live->previous = sample;
+    }
+    profile_live = sample;
+    profile_live_count++;
+    profile_live_bytes += size;
+    profile_unlock();
+    return sample;
+}
+
+/**
+ * Forgets the sample of an allocation that was freed.
+ *
+ * @param sample The sample.
+ */
+void profile_sample_destroy(struct profile_sample* sample) {
+    profile_lock();
+    if (sample->previous) {
+        sample->previous->next = sample->next;
+    } else {
+        profile_live = sample->next;
+    }
+    if (sample->next) {
+        sample->next->previous = sample->previous;
+    }
+    profile_live_count--;
+    profile_live_bytes -= sample->requested_size;
+    sample->next = profile_unused;
+    profile_unused = sample;
+    profile_unlock();
+}
+
+int malloc_profile_dump(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return FALSE;
+    }
+    profile_lock();
+    profile_write_all(fd);
+    profile_unlock();
+    return close(fd) == 0;
+}
+
+/**
+ * Keeps the samples consistent across a fork by holding their lock through it.
+ */
+void profile_prepare_fork() {
+    profile_lock();
+}
+
+void profile_finish_fork() {
+    profile_unlock();
+}
+
+/**
+ * Starts profiling if MALLOC_PROFILE_RATE is set, and writes a profile on every SIGUSR2 if MALLOC_PROFILE_FILE is.
+ */
+__attribute__((constructor)) void profile_start_from_environment() {
+    pthread_atfork(profile_prepare_fork, profile_finish_fork, profile_finish_fork);
+    char* prefix = getenv("MALLOC_PROFILE_FILE");
+    if (prefix && strlen(prefix) < PROFILE_PATH_MAX) {
+        strcpy(profile_prefix, prefix);
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = profile_signal_handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR2, &action, NULL);
+    }
+    char* rate = getenv("MALLOC_PROFILE_RATE");
+    if (rate) {
+        profile_set_rate(strtoul(rate, NULL, 10));
+    }
+}
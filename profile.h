@@ -0,0 +1,37 @@
+/*
+ * profile.h
+ *
+ * Heap profiler: the samples that profile.c attaches to sampled allocations. About one allocation is sampled per
+ * `profile_rate` bytes allocated, and each sample records the stack that made it.
+ */
+#include <stddef.h>
+
+#ifndef ASSIGN3_PROFILE_H
+#define ASSIGN3_PROFILE_H
+
+#define PROFILE_MAX_DEPTH 32
+
+struct profile_sample {
+    // Links in the list of live samples.
+    struct profile_sample* next;
+    struct profile_sample* previous;
+    // The size that was asked for.
+    size_t requested_size;
+    // The return addresses of the allocating stack, innermost first.
+    void* stack[PROFILE_MAX_DEPTH];
+    int depth;
+};
+
+// Decides whether an allocation of `size` bytes is sampled. Costs a single predictable branch while profiling is off.
+#define profile_should_sample(size) \
+    (__builtin_expect(__atomic_load_n(&profile_rate, __ATOMIC_RELAXED) != 0, 0) && profile_count(size))
+
+extern size_t profile_rate;
+
+/** Documentation is available in profile.c */
+void profile_set_rate(size_t rate);
+int profile_count(size_t size);
+struct profile_sample* profile_sample_create(size_t size);
+void profile_sample_destroy(struct profile_sample* sample);
+
+#endif //ASSIGN3_PROFILE_H
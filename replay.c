@@ -0,0 +1,170 @@
+/*
+ * replay.c
+ *
+ * Allocation trace replay: makes the calls recorded in a trace (see trace.h) against malloc.c as `replay`, or against
+ * the C library's malloc as `replay_libc`, and reports the throughput and how far the program break grew. Calls from
+ * every thread are replayed on one thread, in the order they were recorded.
+ *
+ * Usage: replay <trace file>
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef BENCH_LIBC
+#include <malloc.h>
+#else
+#include "malloc.h"
+#endif
+#include "trace.h"
+
+// Marks a slot of the pointer table whose entry was removed.
+#define REMOVED 1
+
+/**
+ * Maps the pointers recorded in the trace to the pointers returned while replaying it, with open addressing.
+ */
+struct pointer_table {
+    uint64_t* keys;
+    void** values;
+    size_t mask;
+};
+
+/**
+ * Reads a monotonic clock.
+ *
+ * @return The current time in nanoseconds.
+ */
+uint64_t now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+/**
+ * Finds the slot of the pointer table that holds `key`, or the empty slot where it would go.
+ *
+ * @param table The pointer table.
+ * @param key The recorded pointer.
+ * @return The index of the slot.
+ */
+size_t table_slot(struct pointer_table* table, uint64_t key) {
+    size_t index = (key >> 4) * 0x9E3779B97F4A7C15ULL & table->mask;
+    while (table->keys[index] && table->keys[index] != key) {
+        index = (index + 1) & table->mask;
+    }
+    return index;
+}
+
+void table_put(struct pointer_table* table, uint64_t key, void* value) {
+    if (!key) {
+        return;
+    }
+    size_t index = table_slot(table, key);
+    table->keys[index] = key;
+    table->values[index] = value;
+}
+
+/**
+ * Removes a recorded pointer from the pointer table.
+ *
+ * @param table The pointer table.
+ * @param key The recorded pointer.
+ * @return The replayed pointer that `key` mapped to, or NULL if it isn't in the table.
+ */
+void* table_take(struct pointer_table* table, uint64_t key) {
+    if (!key) {
+        return NULL;
+    }
+    size_t index = table_slot(table, key);
+    if (!table->keys[index]) {
+        return NULL;
+    }
+    table->keys[index] = REMOVED;
+    return table->values[index];
+}
+
+int main(int argc, char** argv) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return 2;
+    }
+    int fd = open(argv[1], O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) || (size_t) status.st_size < sizeof(struct trace_header)) {
+        fprintf(stderr, "Can't read trace %s.\n", argv[1]);
+        return 1;
+    }
+    struct trace_header* header = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (header == MAP_FAILED || header->magic != TRACE_MAGIC || header->record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s isn't a trace.\n", argv[1]);
+        return 1;
+    }
+    struct trace_record* records = (struct trace_record*) (header + 1);
+    size_t count = (status.st_size - sizeof(struct trace_header)) / sizeof(struct trace_record);
+    for (size_t i = 0; i < count; i++) {
+        if (!records[i].operation) {
+            count = i;
+        }
+    }
+
+    // Keep the table out of the allocator being measured. Every record adds at most one key, so the table never fills.
+    size_t capacity = 16;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+    struct pointer_table table = {
+            mmap(NULL, capacity * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
+            mmap(NULL, capacity * sizeof(void*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
+            capacity - 1};
+
+    char* initial_break = sbrk(0);
+    char* peak_break = initial_break;
+    uint32_t threads = 0;
+    uint64_t elapsed = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct trace_record* record = &records[i];
+        threads = record->thread > threads ? record->thread : threads;
+        void* argument = record->operation == TRACE_REALLOC || record->operation == TRACE_FREE
+                ? table_take(&table, record->argument) : NULL;
+        void* result = NULL;
+        uint64_t start = now();
+        switch (record->operation) {
+            case TRACE_MALLOC:
+                result = malloc(record->size);
+                break;
+            case TRACE_CALLOC:
+                result = calloc(1, record->size);
+                break;
+            case TRACE_REALLOC:
+                result = realloc(argument, record->size);
+                break;
+            case TRACE_FREE:
+                free(argument);
+                break;
+            case TRACE_MEMALIGN:
+                result = memalign(record->argument, record->size);
+                break;
+        }
+        elapsed += now() - start;
+        table_put(&table, record->result, result);
+        char* current_break = sbrk(0);
+        peak_break = current_break > peak_break ? current_break : peak_break;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Records replayed: %zu from %u threads\n", count, threads);
+    printf("Throughput: %.0f calls/sec\n", elapsed ? count / (elapsed / 1e9) : 0);
+    printf("Program break grew by %ld bytes (peak %ld bytes)\n", (char*) sbrk(0) - initial_break,
+           peak_break - initial_break);
+    printf("Peak RSS: %ld KiB\n", usage.ru_maxrss);
+    return 0;
+}
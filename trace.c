@@ -0,0 +1,161 @@
+/*
+ * trace.c
+ *
+ * Allocation trace recorder: appends a record (see trace.h) for every allocation call to a memory-mapped file, so that
+ * recording never allocates and costs little more than a clock read. Recording starts when the program is loaded if
+ * MALLOC_TRACE_FILE is set, or on `malloc_trace_start`.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "malloc.h"
+#include "trace.h"
+
+#define TRUE 1
+#define FALSE 0
+// The biggest a trace file can grow to. The file is sparse until it is truncated, so only written records take space.
+#define TRACE_CAPACITY ((size_t) 1 << 34)
+#define TRACE_MAX_RECORDS ((TRACE_CAPACITY - sizeof(struct trace_header)) / sizeof(struct trace_record))
+#define TRACE_PATH_MAX 4096
+
+int trace_enabled = FALSE;
+int trace_fd = -1;
+struct trace_record* trace_records = NULL;
+// The number of records handed out so far. Past TRACE_MAX_RECORDS, records are dropped.
+size_t trace_reserved = 0;
+uint64_t trace_start_time = 0;
+uint32_t trace_thread_count = 0;
+__thread uint32_t trace_thread __attribute__((tls_model("initial-exec")));
+
+/**
+ * Reads the time since recording started.
+ *
+ * @return The time in nanoseconds.
+ */
+uint64_t trace_time() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec - trace_start_time;
+}
+
+/**
+ * Appends a record of an allocation call to the trace. Every record gets its own slot in the file up front, so
+ * threads record at the same time without a lock.
+ *
+ * @param operation One of the TRACE_* operations.
+ * @param result The pointer returned by the call.
+ * @param argument The pointer or alignment passed to the call.
+ * @param size The size requested.
+ */
+void trace_record(uint32_t operation, void* result, void* argument, size_t size) {
+    size_t index = __atomic_fetch_add(&trace_reserved, 1, __ATOMIC_RELAXED);
+    if (index >= TRACE_MAX_RECORDS) {
+        return;
+    }
+    if (!trace_thread) {
+        trace_thread = __atomic_add_fetch(&trace_thread_count, 1, __ATOMIC_RELAXED);
+    }
+    struct trace_record* record = &trace_records[index];
+    record->time = trace_time();
+    record->result = (uintptr_t) result;
+    record->argument = (uintptr_t) argument;
+    record->size = size;
+    record->thread = trace_thread;
+    // Written last, so that a record cut off by a crash reads as the end of the trace.
+    __atomic_store_n(&record->operation, operation, __ATOMIC_RELEASE);
+}
+
+int malloc_trace_start(const char* path) {
+    // A trace can only be recorded once per process, since writers may still hold slots in the previous mapping.
+    if (trace_records) {
+        return FALSE;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return FALSE;
+    }
+    struct trace_header* header = MAP_FAILED;
+    if (ftruncate(fd, TRACE_CAPACITY) == 0) {
+        header = mmap(NULL, TRACE_CAPACITY, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    }
+    if (header == MAP_FAILED) {
+        close(fd);
+        unlink(path);
+        return FALSE;
+    }
+    header->magic = TRACE_MAGIC;
+    header->record_size = sizeof(struct trace_record);
+    trace_fd = fd;
+    trace_records = (struct trace_record*) (header + 1);
+    trace_start_time = 0;
+    trace_start_time = trace_time();
+    __atomic_store_n(&trace_enabled, TRUE, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+void malloc_trace_stop() {
+    if (!__atomic_exchange_n(&trace_enabled, FALSE, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    // Stop handing out slots, then cut the file down to the slots already handed out. The mapping is kept, since other
+    // threads may still be writing to their slots.
+    size_t used = __atomic_exchange_n(&trace_reserved, TRACE_MAX_RECORDS, __ATOMIC_ACQ_REL);
+    used = used < TRACE_MAX_RECORDS ? used : TRACE_MAX_RECORDS;
+    ftruncate(trace_fd, sizeof(struct trace_header) + used * sizeof(struct trace_record));
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+/**
+ * Stops recording in the child of a fork, which would otherwise write over the parent's records.
+ */
+void trace_fork_child() {
+    __atomic_store_n(&trace_enabled, FALSE, __ATOMIC_RELAXED);
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+/**
+ * Starts recording if MALLOC_TRACE_FILE is set. A "%p" in the path is replaced by the process ID, so that programs
+ * that start other programs get one trace per process.
+ */
+__attribute__((constructor)) void trace_start_from_environment() {
+    pthread_atfork(NULL, NULL, trace_fork_child);
+    char* pattern = getenv("MALLOC_TRACE_FILE");
+    if (!pattern) {
+        return;
+    }
+    char path[TRACE_PATH_MAX];
+    size_t length = 0;
+    for (char* c = pattern; *c && length < TRACE_PATH_MAX - 20; c++) {
+        if (c[0] == '%' && c[1] == 'p') {
+            char digits[20];
+            int count = 0;
+            for (pid_t pid = getpid(); pid; pid /= 10) {
+                digits[count++] = (char) ('0' + pid % 10);
+            }
+            while (count) {
+                path[length++] = digits[--count];
+            }
+            c++;
+        } else {
+            path[length++] = *c;
+        }
+    }
+    path[length] = '\0';
+    malloc_trace_start(path);
+}
+
+/**
+ * Finishes the trace when the program exits.
+ */
+__attribute__((destructor)) void trace_stop_on_exit() {
+    malloc_trace_stop();
+}
@@ -0,0 +1,55 @@
+/*
+ * trace.h
+ *
+ * Allocation traces: the binary format written by the recorder in trace.c and read back by replay.c. A trace is a
+ * trace_header followed by trace_records in the order their calls were made. A record with operation 0 marks the end
+ * of a trace that was cut short.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef ASSIGN3_TRACE_H
+#define ASSIGN3_TRACE_H
+
+#define TRACE_MAGIC 0x45434152544C4C41ULL
+
+#define TRACE_MALLOC 1
+#define TRACE_CALLOC 2
+#define TRACE_REALLOC 3
+#define TRACE_FREE 4
+#define TRACE_MEMALIGN 5
+
+struct trace_header {
+    uint64_t magic;
+    uint64_t record_size;
+};
+
+struct trace_record {
+    // Nanoseconds since recording started.
+    uint64_t time;
+    // The pointer returned by the call, or 0 for `free`.
+    uint64_t result;
+    // The pointer passed to `realloc` or `free`, or the alignment passed to `memalign`.
+    uint64_t argument;
+    // The size requested, `num_elements * element_size` for `calloc`.
+    uint64_t size;
+    // A small number identifying the calling thread, counting from 1.
+    uint32_t thread;
+    // One of the TRACE_* operations above.
+    uint32_t operation;
+};
+
+// Records a call if a trace is being recorded. Costs a single predictable branch otherwise.
+#define trace(operation, result, argument, size) \
+    do { \
+        if (__builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)) { \
+            trace_record(operation, result, argument, size); \
+        } \
+    } while (0)
+
+extern int trace_enabled;
+
+/** Documentation is available in trace.c */
+void trace_record(uint32_t operation, void* result, void* argument, size_t size);
+
+#endif //ASSIGN3_TRACE_H